@@ -1,6 +1,10 @@
 #include "aotjs_runtime.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
 
 #ifdef DEBUG
 #include <iostream>
@@ -9,6 +13,25 @@
 #include <chrono>
 #include <sstream>
 
+#ifdef AOTJS_MMAP
+#include <sys/mman.h>
+#endif
+
+#ifdef VAL_COMPRESSED
+#include <map>
+#endif
+
+#ifdef AOTJS_THREADS
+#include <atomic>
+#include <memory>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define AOTJS_PREFETCH(aPtr) __builtin_prefetch(aPtr)
+#else
+#define AOTJS_PREFETCH(aPtr)
+#endif
+
 namespace AotJS {
   TypeOf typeOfGCThing = "gcthing"; // base class should not be exposed
   TypeOf typeOfInternal = "internal"; // internal class should not be exposed
@@ -26,6 +49,20 @@ namespace AotJS {
   TypeOf typeOfSymbol = "symbol";
   TypeOf typeOfFunction = "function";
   TypeOf typeOfObject = "object";
+
+  // Indexed by GCKind.
+  static const TypeOf typeOfKind[] = {
+    typeOfGCThing,
+    typeOfInternal,
+    typeOfInternal, // Cell
+    typeOfJSThing,
+    typeOfBoxDouble,
+    typeOfBoxInt32,
+    typeOfString,
+    typeOfSymbol,
+    typeOfObject,
+    typeOfFunction
+  };
 }
 
 #pragma mark Val hash helpers
@@ -33,7 +70,10 @@ namespace AotJS {
 namespace std {
   size_t hash<::AotJS::Val>::operator()(::AotJS::Val const& ref) const noexcept {
     if (ref.isString()) {
-      return hash<string>{}(ref.asString());
+      return ref.asString().hash();
+    } else if (ref.isNumber()) {
+      // Equal numbers may be encoded or boxed differently.
+      return hash<double>{}(ref.toDouble());
     } else {
       return hash<uint64_t>{}(ref.raw());
     }
@@ -49,24 +89,61 @@ namespace AotJS {
     if (raw() == rhs.raw()) {
       return true;
     }
-
-    if (isString() || rhs.isString()) {
+    if (isNumber() && rhs.isNumber()) {
+      // Equal numbers may be encoded or boxed differently, and NaN
+      // matches itself.
+      double lhsDouble = toDouble();
+      double rhsDouble = rhs.toDouble();
+      return lhsDouble == rhsDouble || (lhsDouble != lhsDouble && rhsDouble != rhsDouble);
+    }
+    if (isString() && rhs.isString()) {
       // Two string instances may still compare equal.
-      return toString()->str() == rhs.toString()->str();
+      return asString() == rhs.asString();
+    }
+    return false;
+  }
+
+  bool Val::strictEquals(const Val &rhs) const {
+    if (isInt32() && rhs.isInt32()) {
+      return asInt32() == rhs.asInt32();
+    }
+    if (isNumber() && rhs.isNumber()) {
+      return toDouble() == rhs.toDouble();
+    }
+    if (raw() == rhs.raw()) {
+      return true;
     }
+    if (isString() && rhs.isString()) {
+      return asString() == rhs.asString();
+    }
+    return false;
+  }
 
-    // fixme handle box types better
+  bool Val::looseEquals(const Val &rhs) const {
     if (isInt32() && rhs.isInt32()) {
       return asInt32() == rhs.asInt32();
     }
-    if (isDouble() || rhs.isDouble()) {
+    if (isNumber() && rhs.isNumber()) {
       return toDouble() == rhs.toDouble();
     }
-    if (isObject() || rhs.isObject()) {
-      // Non-identical non-string objects never compare identical.
+    if (raw() == rhs.raw()) {
+      return true;
+    }
+    if (isString() && rhs.isString()) {
+      return asString() == rhs.asString();
+    }
+    // null and undefined only match each other.
+    bool lhsNullish = isNull() || isUndefined();
+    bool rhsNullish = rhs.isNull() || rhs.isUndefined();
+    if (lhsNullish || rhsNullish) {
+      return lhsNullish && rhsNullish;
+    }
+    // Objects and symbols only match themselves (there's no ToPrimitive
+    // yet). What's left mixes numbers, strings and booleans, which
+    // compare by ToNumber.
+    if (isReference() || rhs.isReference()) {
       return false;
     }
-    // hack for box doubles
     return toDouble() == rhs.toDouble();
   }
 
@@ -78,7 +155,9 @@ namespace AotJS {
     } else if (isInt32()) {
       return static_cast<bool>(asInt32());
     } else if (isDouble()) {
-      return static_cast<bool>(asDouble());
+      // NaN is falsy too.
+      double d = asDouble();
+      return d == d && d != 0;
     } else if (isUndefined()) {
       return false;
     } else if (isNull()) {
@@ -90,18 +169,50 @@ namespace AotJS {
     }
   }
 
-  int32_t Val::toInt32() const
+  int32_t toInt32(double aDouble)
   {
-    if (isGCThing()) {
-      return asGCThing().toInt32();
+    // In range, truncation is all there is to it. NaN fails both tests.
+    if (aDouble > -2147483649.0 && aDouble < 2147483648.0) {
+      return static_cast<int32_t>(aDouble);
     }
-    if (isInt31()) {
-      return asInt31();
+
+    // Otherwise |aDouble| >= 2^31, so it's an integer: take the low 32 bits
+    // of the mantissa shifted by its exponent. Infinity and NaN have all
+    // their bits shifted out and come out as 0.
+    uint64_t bits;
+    std::memcpy(&bits, &aDouble, sizeof(bits));
+    int exponent = static_cast<int>((bits >> 52) & 0x7ff) - 1075;
+    uint64_t mantissa = (bits & ((uint64_t(1) << 52) - 1)) | (uint64_t(1) << 52);
+    uint32_t low;
+    if (exponent >= 32) {
+      low = 0;
+    } else if (exponent >= 0) {
+      low = static_cast<uint32_t>(mantissa << exponent);
+    } else {
+      low = static_cast<uint32_t>(mantissa >> -exponent);
+    }
+    if (bits >> 63) {
+      low = 0u - low;
     }
+    return static_cast<int32_t>(low);
+  }
+
+  uint32_t toUint32(double aDouble)
+  {
+    return static_cast<uint32_t>(toInt32(aDouble));
+  }
+
+  int32_t Val::toInt32() const
+  {
     if (isInt32()) {
       return asInt32();
     }
-    return static_cast<int32_t>(asDouble());
+    return AotJS::toInt32(toDouble());
+  }
+
+  uint32_t Val::toUint32() const
+  {
+    return static_cast<uint32_t>(toInt32());
   }
 
   double Val::toDouble() const
@@ -109,6 +220,8 @@ namespace AotJS {
     #ifdef VAL_TAGGED_POINTER
     if (isInt31()) {
       return static_cast<double>(asInt31());
+    } else if (isImmediate()) {
+      return immediateToDouble();
     } else {
       // Everything else is an object type.
       return asGCThing().toDouble();
@@ -123,6 +236,8 @@ namespace AotJS {
       return asGCThing().toDouble();
     } else if (tag_ == tagBitsInt32) {
       return static_cast<double>(asInt32());
+    } else if (tag_ == tagBitsImmediate) {
+      return immediateToDouble();
     } else {
       // Everything else is an encoded double.
       return asDouble();
@@ -130,25 +245,35 @@ namespace AotJS {
     #endif
   }
 
+  double Val::immediateToDouble() const
+  {
+    if (isUndefined()) {
+      return NAN;
+    }
+    return asBool() ? 1.0 : 0.0;
+  }
+
   Retained<String> Val::toString() const
   {
     ScopeRet<String> scope;
-    if (isGCThing()) {
+    if (isNumber()) {
+      // Boxed numbers too, in the tagged layouts.
+      char buf[maxNumberLength];
+      return scope.escape(String::create(buf, numberToString(toDouble(), buf)));
+    } else if (isGCThing()) {
       return scope.escape(asGCThing().toString());
     } else {
-      return scope.escape(retain<String>(dump()));
+      return scope.escape(String::create(dump()));
     }
   }
 
   string Val::dump() const {
+    if (isNumber()) {
+      char chars[maxNumberLength];
+      return string(chars, numberToString(toDouble(), chars));
+    }
     std::ostringstream buf;
-    if (isDouble()) {
-      buf << asDouble();
-    } else if (isInt32()) {
-      buf << asInt32();
-    } else if (isInt31()) {
-      buf << asInt31();
-    } else if (isBool()) {
+    if (isBool()) {
       if (asBool()) {
         buf << "true";
       } else {
@@ -158,6 +283,8 @@ namespace AotJS {
       buf << "null";
     } else if (isUndefined()) {
       buf << "undefined";
+    } else if (isDeleted()) {
+      buf << "deleted";
     } else if (isGCThing()) {
       buf << asGCThing().dump();
     }
@@ -177,187 +304,1062 @@ namespace AotJS {
     }
   }
 
-  #pragma mark operators
+  #pragma mark Number conversions
 
-  Local operator+(Local lhs, Local rhs) {
-    ScopeRetVal scope;
-    // todo implement this correctly
-    if (lhs->isString() || rhs->isString()) {
-      return scope.escape(new String(lhs->toString()->str() + rhs->toString()->str()));
-    } else {
-      return scope.escape(lhs->toDouble() + rhs->toDouble());
+  // A double as f * 2^e, with a full 64-bit significand once normalized.
+  struct DiyFp {
+    uint64_t f;
+    int e;
+  };
+
+  static DiyFp normalize(DiyFp aFp) {
+    while (!(aFp.f & (uint64_t(1) << 63))) {
+      aFp.f <<= 1;
+      aFp.e--;
     }
+    return aFp;
   }
 
-  Local operator+(double lhs, Local rhs) {
-    ScopeRetVal scope;
-    // todo implement this correctly
-    if (rhs->isString()) {
-      return scope.escape(new String(Local(lhs)->toString()->str() + rhs->toString()->str()));
+  // Product rounded to the top 64 bits, in halves so it doesn't need a
+  // 128-bit type.
+  static DiyFp multiply(DiyFp x, DiyFp y) {
+    const uint64_t mask = 0xffffffff;
+    uint64_t a = x.f >> 32, b = x.f & mask;
+    uint64_t c = y.f >> 32, d = y.f & mask;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & mask) + (bc & mask) + (uint64_t(1) << 31);
+    return { ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+  }
+
+  // 10^k for every eighth k from -348 to 340, normalized and rounded.
+  struct CachedPower {
+    uint64_t f;
+    int16_t e;
+    int16_t k;
+  };
+
+  static const CachedPower cachedPowers[] = {
+    { 0xfa8fd5a0081c0288, -1220, -348 },
+    { 0xbaaee17fa23ebf76, -1193, -340 },
+    { 0x8b16fb203055ac76, -1166, -332 },
+    { 0xcf42894a5dce35ea, -1140, -324 },
+    { 0x9a6bb0aa55653b2d, -1113, -316 },
+    { 0xe61acf033d1a45df, -1087, -308 },
+    { 0xab70fe17c79ac6ca, -1060, -300 },
+    { 0xff77b1fcbebcdc4f, -1034, -292 },
+    { 0xbe5691ef416bd60c, -1007, -284 },
+    { 0x8dd01fad907ffc3c,  -980, -276 },
+    { 0xd3515c2831559a83,  -954, -268 },
+    { 0x9d71ac8fada6c9b5,  -927, -260 },
+    { 0xea9c227723ee8bcb,  -901, -252 },
+    { 0xaecc49914078536d,  -874, -244 },
+    { 0x823c12795db6ce57,  -847, -236 },
+    { 0xc21094364dfb5637,  -821, -228 },
+    { 0x9096ea6f3848984f,  -794, -220 },
+    { 0xd77485cb25823ac7,  -768, -212 },
+    { 0xa086cfcd97bf97f4,  -741, -204 },
+    { 0xef340a98172aace5,  -715, -196 },
+    { 0xb23867fb2a35b28e,  -688, -188 },
+    { 0x84c8d4dfd2c63f3b,  -661, -180 },
+    { 0xc5dd44271ad3cdba,  -635, -172 },
+    { 0x936b9fcebb25c996,  -608, -164 },
+    { 0xdbac6c247d62a584,  -582, -156 },
+    { 0xa3ab66580d5fdaf6,  -555, -148 },
+    { 0xf3e2f893dec3f126,  -529, -140 },
+    { 0xb5b5ada8aaff80b8,  -502, -132 },
+    { 0x87625f056c7c4a8b,  -475, -124 },
+    { 0xc9bcff6034c13053,  -449, -116 },
+    { 0x964e858c91ba2655,  -422, -108 },
+    { 0xdff9772470297ebd,  -396, -100 },
+    { 0xa6dfbd9fb8e5b88f,  -369,  -92 },
+    { 0xf8a95fcf88747d94,  -343,  -84 },
+    { 0xb94470938fa89bcf,  -316,  -76 },
+    { 0x8a08f0f8bf0f156b,  -289,  -68 },
+    { 0xcdb02555653131b6,  -263,  -60 },
+    { 0x993fe2c6d07b7fac,  -236,  -52 },
+    { 0xe45c10c42a2b3b06,  -210,  -44 },
+    { 0xaa242499697392d3,  -183,  -36 },
+    { 0xfd87b5f28300ca0e,  -157,  -28 },
+    { 0xbce5086492111aeb,  -130,  -20 },
+    { 0x8cbccc096f5088cc,  -103,  -12 },
+    { 0xd1b71758e219652c,   -77,   -4 },
+    { 0x9c40000000000000,   -50,    4 },
+    { 0xe8d4a51000000000,   -24,   12 },
+    { 0xad78ebc5ac620000,     3,   20 },
+    { 0x813f3978f8940984,    30,   28 },
+    { 0xc097ce7bc90715b3,    56,   36 },
+    { 0x8f7e32ce7bea5c70,    83,   44 },
+    { 0xd5d238a4abe98068,   109,   52 },
+    { 0x9f4f2726179a2245,   136,   60 },
+    { 0xed63a231d4c4fb27,   162,   68 },
+    { 0xb0de65388cc8ada8,   189,   76 },
+    { 0x83c7088e1aab65db,   216,   84 },
+    { 0xc45d1df942711d9a,   242,   92 },
+    { 0x924d692ca61be758,   269,  100 },
+    { 0xda01ee641a708dea,   295,  108 },
+    { 0xa26da3999aef774a,   322,  116 },
+    { 0xf209787bb47d6b85,   348,  124 },
+    { 0xb454e4a179dd1877,   375,  132 },
+    { 0x865b86925b9bc5c2,   402,  140 },
+    { 0xc83553c5c8965d3d,   428,  148 },
+    { 0x952ab45cfa97a0b3,   455,  156 },
+    { 0xde469fbd99a05fe3,   481,  164 },
+    { 0xa59bc234db398c25,   508,  172 },
+    { 0xf6c69a72a3989f5c,   534,  180 },
+    { 0xb7dcbf5354e9bece,   561,  188 },
+    { 0x88fcf317f22241e2,   588,  196 },
+    { 0xcc20ce9bd35c78a5,   614,  204 },
+    { 0x98165af37b2153df,   641,  212 },
+    { 0xe2a0b5dc971f303a,   667,  220 },
+    { 0xa8d9d1535ce3b396,   694,  228 },
+    { 0xfb9b7cd9a4a7443c,   720,  236 },
+    { 0xbb764c4ca7a44410,   747,  244 },
+    { 0x8bab8eefb6409c1a,   774,  252 },
+    { 0xd01fef10a657842c,   800,  260 },
+    { 0x9b10a4e5e9913129,   827,  268 },
+    { 0xe7109bfba19c0c9d,   853,  276 },
+    { 0xac2820d9623bf429,   880,  284 },
+    { 0x80444b5e7aa7cf85,   907,  292 },
+    { 0xbf21e44003acdd2d,   933,  300 },
+    { 0x8e679c2f5e44ff8f,   960,  308 },
+    { 0xd433179d9c8cb841,   986,  316 },
+    { 0x9e19db92b4e31ba9,  1013,  324 },
+    { 0xeb96bf6ebadf77d9,  1039,  332 },
+    { 0xaf87023b9bf0ee6b,  1066,  340 },
+  };
+
+  // Scaled results land with a binary exponent in this range, so digit
+  // generation can split them into 32-bit integral and fractional parts.
+  static const int minTargetExponent = -60;
+  static const int maxTargetExponent = -32;
+
+  static const CachedPower& cachedPowerFor(int aMinExponent) {
+    // 0.30103 is log10(2); entries are 8 decimal exponents apart.
+    int k = static_cast<int>(std::ceil((aMinExponent + 63) * 0.30102999566398114));
+    return cachedPowers[(348 + k - 1) / 8 + 1];
+  }
+
+  // Move the last digit down while that brings it closer to the real
+  // value, then check it's guaranteed to be both closest and inside the
+  // rounding interval. Returns false if the imprecision of the scaled
+  // arithmetic makes that uncertain.
+  static bool roundWeed(char* aBuffer, int aLength, uint64_t aDistanceTooHigh, uint64_t aUnsafeInterval,
+                        uint64_t aRest, uint64_t aTenKappa, uint64_t aUnit)
+  {
+    uint64_t smallDistance = aDistanceTooHigh - aUnit;
+    uint64_t bigDistance = aDistanceTooHigh + aUnit;
+    while (aRest < smallDistance &&
+           aUnsafeInterval - aRest >= aTenKappa &&
+           (aRest + aTenKappa < smallDistance ||
+            smallDistance - aRest >= aRest + aTenKappa - smallDistance)) {
+      aBuffer[aLength - 1]--;
+      aRest += aTenKappa;
+    }
+    if (aRest < bigDistance &&
+        aUnsafeInterval - aRest >= aTenKappa &&
+        (aRest + aTenKappa < bigDistance ||
+         bigDistance - aRest > aRest + aTenKappa - bigDistance)) {
+      return false;
+    }
+    return 2 * aUnit <= aRest && aRest <= aUnsafeInterval - 4 * aUnit;
+  }
+
+  // Grisu3: generate the shortest digits inside the rounding interval,
+  // bailing out in the rare cases where it can't be sure.
+  static bool grisu3(double aDouble, char* aBuffer, int& aLength, int& aExponent) {
+    uint64_t bits;
+    std::memcpy(&bits, &aDouble, sizeof(bits));
+    const uint64_t hidden = uint64_t(1) << 52;
+    uint64_t fraction = bits & (hidden - 1);
+    int biased = static_cast<int>(bits >> 52);
+    DiyFp v = biased ? DiyFp{ fraction | hidden, biased - 1075 } : DiyFp{ fraction, -1074 };
+
+    // The interval of values that read back as aDouble. Its lower half is
+    // narrower just above a power of two.
+    DiyFp plus = normalize({ (v.f << 1) + 1, v.e - 1 });
+    DiyFp minus = (fraction == 0 && biased > 1) ? DiyFp{ (v.f << 2) - 1, v.e - 2 }
+                                                 : DiyFp{ (v.f << 1) - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    DiyFp w = normalize(v);
+
+    const CachedPower& power = cachedPowerFor(minTargetExponent - (w.e + 64));
+    DiyFp tenMk = { power.f, power.e };
+    DiyFp scaledW = multiply(w, tenMk);
+    DiyFp low = multiply(minus, tenMk);
+    DiyFp high = multiply(plus, tenMk);
+
+    // Each scaled value may be off by one unit, so only the part of the
+    // interval that's certain either way is safe.
+    uint64_t unit = 1;
+    DiyFp tooLow = { low.f - unit, low.e };
+    DiyFp tooHigh = { high.f + unit, high.e };
+    uint64_t unsafeInterval = tooHigh.f - tooLow.f;
+    int shift = -scaledW.e;
+    uint64_t one = uint64_t(1) << shift;
+    uint32_t integrals = static_cast<uint32_t>(tooHigh.f >> shift);
+    uint64_t fractionals = tooHigh.f & (one - 1);
+
+    uint32_t divisor = 1;
+    int kappa = 1;
+    while (divisor <= integrals / 10) {
+      divisor *= 10;
+      kappa++;
+    }
+
+    aLength = 0;
+    while (kappa > 0) {
+      aBuffer[aLength++] = static_cast<char>('0' + integrals / divisor);
+      integrals %= divisor;
+      kappa--;
+      uint64_t rest = (static_cast<uint64_t>(integrals) << shift) + fractionals;
+      if (rest < unsafeInterval) {
+        aExponent = kappa - power.k;
+        return roundWeed(aBuffer, aLength, tooHigh.f - scaledW.f, unsafeInterval, rest,
+                         static_cast<uint64_t>(divisor) << shift, unit);
+      }
+      divisor /= 10;
+    }
+    for (;;) {
+      fractionals *= 10;
+      unit *= 10;
+      unsafeInterval *= 10;
+      aBuffer[aLength++] = static_cast<char>('0' + (fractionals >> shift));
+      fractionals &= one - 1;
+      kappa--;
+      if (fractionals < unsafeInterval) {
+        aExponent = kappa - power.k;
+        return roundWeed(aBuffer, aLength, (tooHigh.f - scaledW.f) * unit, unsafeInterval, fractionals,
+                         one, unit);
+      }
+    }
+  }
+
+  // The exact fallback: the first precision at which the correctly
+  // rounded digits read back. Only taken for the ~0.5% Grisu3 rejects.
+  static void shortestBySearch(double aDouble, char* aBuffer, int& aLength, int& aExponent) {
+    char formatted[32];
+    for (int precision = 1; precision <= 17; precision++) {
+      std::snprintf(formatted, sizeof(formatted), "%.*e", precision - 1, aDouble);
+      if (precision == 17 || std::strtod(formatted, nullptr) == aDouble) {
+        break;
+      }
+    }
+    // d.ddde[+-]xx
+    aLength = 0;
+    const char* c = formatted;
+    for (; *c != 'e'; c++) {
+      if (*c != '.') {
+        aBuffer[aLength++] = *c;
+      }
+    }
+    while (aLength > 1 && aBuffer[aLength - 1] == '0') {
+      aLength--;
+    }
+    aExponent = std::atoi(c + 1) - (aLength - 1);
+  }
+
+  static size_t writeDigits(uint64_t aValue, char* aBuffer) {
+    char reversed[20];
+    size_t length = 0;
+    do {
+      reversed[length++] = static_cast<char>('0' + aValue % 10);
+      aValue /= 10;
+    } while (aValue);
+    for (size_t i = 0; i < length; i++) {
+      aBuffer[i] = reversed[length - 1 - i];
+    }
+    return length;
+  }
+
+  size_t numberToString(double aNumber, char* aBuffer) {
+    if (aNumber != aNumber) {
+      std::memcpy(aBuffer, "NaN", 3);
+      return 3;
+    }
+    char* out = aBuffer;
+    if (aNumber < 0) {
+      *out++ = '-';
+      aNumber = -aNumber;
+    }
+    if (aNumber == INFINITY) {
+      std::memcpy(out, "Infinity", 8);
+      return out + 8 - aBuffer;
+    }
+    // Integers print directly, which also takes care of both zeroes.
+    if (aNumber < 9007199254740992.0 && aNumber == std::floor(aNumber)) {
+      if (aNumber == 0) {
+        aBuffer[0] = '0';
+        return 1;
+      }
+      return out + writeDigits(static_cast<uint64_t>(aNumber), out) - aBuffer;
+    }
+
+    char digits[18];
+    int length, exponent;
+    if (!grisu3(aNumber, digits, length, exponent)) {
+      shortestBySearch(aNumber, digits, length, exponent);
+    }
+
+    // Lay out digits * 10^exponent as Number::toString does, by where the
+    // decimal point falls.
+    int point = length + exponent;
+    if (length <= point && point <= 21) {
+      std::memcpy(out, digits, length);
+      std::memset(out + length, '0', point - length);
+      out += point;
+    } else if (0 < point && point <= 21) {
+      std::memcpy(out, digits, point);
+      out[point] = '.';
+      std::memcpy(out + point + 1, digits + point, length - point);
+      out += length + 1;
+    } else if (-6 < point && point <= 0) {
+      out[0] = '0';
+      out[1] = '.';
+      std::memset(out + 2, '0', -point);
+      std::memcpy(out + 2 - point, digits, length);
+      out += 2 - point + length;
     } else {
-      return scope.escape(lhs + rhs->toDouble());
+      *out++ = digits[0];
+      if (length > 1) {
+        *out++ = '.';
+        std::memcpy(out, digits + 1, length - 1);
+        out += length - 1;
+      }
+      *out++ = 'e';
+      *out++ = point - 1 < 0 ? '-' : '+';
+      out += writeDigits(static_cast<uint64_t>(std::abs(point - 1)), out);
+    }
+    return out - aBuffer;
+  }
+
+  static const double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  static bool isWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+  }
+
+  double stringToNumber(const char* aChars, size_t aLength) {
+    // Surrounding whitespace is ignored, leaving an empty string as 0.
+    const char* c = aChars;
+    const char* end = aChars + aLength;
+    while (c < end && isWhitespace(*c)) {
+      c++;
+    }
+    while (end > c && isWhitespace(end[-1])) {
+      end--;
+    }
+    if (c == end) {
+      return 0.0;
+    }
+    const char* start = c;
+
+    if (end - c > 2 && c[0] == '0') {
+      int radix = 0;
+      switch (c[1]) {
+        case 'x': case 'X': radix = 16; break;
+        case 'o': case 'O': radix = 8; break;
+        case 'b': case 'B': radix = 2; break;
+      }
+      if (radix) {
+        double result = 0.0;
+        for (c += 2; c < end; c++) {
+          int digit = *c >= '0' && *c <= '9' ? *c - '0'
+                    : *c >= 'a' && *c <= 'z' ? *c - 'a' + 10
+                    : *c >= 'A' && *c <= 'Z' ? *c - 'A' + 10
+                    : radix;
+          if (digit >= radix) {
+            return NAN;
+          }
+          result = result * radix + digit;
+        }
+        return result;
+      }
+    }
+
+    bool negative = *c == '-';
+    if (*c == '+' || *c == '-') {
+      c++;
+    }
+    if (end - c == 8 && std::memcmp(c, "Infinity", 8) == 0) {
+      return negative ? -INFINITY : INFINITY;
+    }
+
+    // Gather up to 19 significant digits, which always fit a uint64_t.
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool sawDigit = false;
+    bool truncated = false;
+    for (; c < end && *c >= '0' && *c <= '9'; c++) {
+      sawDigit = true;
+      if (significant < 19) {
+        mantissa = mantissa * 10 + (*c - '0');
+        significant += mantissa != 0;
+      } else {
+        exponent++;
+        truncated |= *c != '0';
+      }
+    }
+    if (c < end && *c == '.') {
+      for (c++; c < end && *c >= '0' && *c <= '9'; c++) {
+        sawDigit = true;
+        if (significant < 19) {
+          mantissa = mantissa * 10 + (*c - '0');
+          significant += mantissa != 0;
+          exponent--;
+        } else {
+          truncated |= *c != '0';
+        }
+      }
+    }
+    if (!sawDigit) {
+      return NAN;
+    }
+    if (c < end && (*c == 'e' || *c == 'E')) {
+      c++;
+      bool negativeExponent = c < end && *c == '-';
+      if (c < end && (*c == '+' || *c == '-')) {
+        c++;
+      }
+      if (c == end) {
+        return NAN;
+      }
+      int written = 0;
+      for (; c < end && *c >= '0' && *c <= '9'; c++) {
+        // Anything this big over- or underflows anyway.
+        if (written < 100000) {
+          written = written * 10 + (*c - '0');
+        }
+      }
+      exponent += negativeExponent ? -written : written;
+    }
+    if (c != end) {
+      return NAN;
+    }
+
+    // Clinger's fast path: an exact mantissa and an exact power of ten
+    // give a correctly rounded result in one operation.
+    if (!truncated && mantissa < (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+      double result = static_cast<double>(mantissa);
+      result = exponent < 0 ? result / exactPowersOfTen[-exponent] : result * exactPowersOfTen[exponent];
+      return negative ? -result : result;
+    }
+
+    // Otherwise the C library rounds it correctly, from a terminated copy
+    // since we've already checked the syntax.
+    string copy(start, end - start);
+    return std::strtod(copy.c_str(), nullptr);
+  }
+
+  #pragma mark operators
+
+  // Int32 operands for the arithmetic fast paths. Only int32-tagged Vals
+  // count; integral results get that tag in Temp::toVal(), which leaves -0
+  // a double.
+  static bool exactInt32(const Val& aVal, int32_t& aOut) {
+    if (aVal.isInt32()) {
+      aOut = aVal.asInt32();
+      return true;
+    }
+    return false;
+  }
+
+  // Each of these gives false if the result isn't exactly an int32,
+  // leaving the caller to fall back to doubles.
+  //
+  // Only the operators that update a Local in place use these; the rest
+  // produce doubles, which come back int32-tagged when they're stored.
+  static bool addInt32(int32_t aLhs, int32_t aRhs, int32_t& aOut) {
+    return !__builtin_add_overflow(aLhs, aRhs, &aOut);
+  }
+
+  static bool subInt32(int32_t aLhs, int32_t aRhs, int32_t& aOut) {
+    return !__builtin_sub_overflow(aLhs, aRhs, &aOut);
+  }
+
+  static bool mulInt32(int32_t aLhs, int32_t aRhs, int32_t& aOut) {
+    if (__builtin_mul_overflow(aLhs, aRhs, &aOut)) {
+      return false;
+    }
+    // A zero with a negative operand is -0.
+    return aOut != 0 || (aLhs >= 0 && aRhs >= 0);
+  }
+
+  static bool divInt32(int32_t aLhs, int32_t aRhs, int32_t& aOut) {
+    if (aRhs == 0 || (aLhs == INT32_MIN && aRhs == -1) || aLhs % aRhs != 0) {
+      return false;
     }
+    if (aLhs == 0 && aRhs < 0) {
+      // -0
+      return false;
+    }
+    aOut = aLhs / aRhs;
+    return true;
   }
 
-  Local operator+(Local lhs, double rhs) {
+  // None of the arithmetic operators make temporaries: numbers come back
+  // as doubles or in a Temp, and only a string concatenation roots its
+  // result, in the caller's scope.
+  static Temp concat(const Temp& lhs, const Temp& rhs) {
     ScopeRetVal scope;
-    // todo implement this correctly
-    if (lhs->isString()) {
-      return scope.escape(new String(lhs->toString()->str() + Local(rhs)->toString()->str()));
-    } else {
-      return scope.escape(lhs->toDouble() + rhs);
+    Local lhsVal(lhs);
+    Local rhsVal(rhs);
+    return Temp(scope.escape(String::concat(lhsVal->toString(), rhsVal->toString())));
+  }
+
+  static Temp add(const Temp& lhs, const Temp& rhs) {
+    if (lhs.isString() || rhs.isString()) {
+      return concat(lhs, rhs);
     }
+    return Temp(lhs.toDouble() + rhs.toDouble());
+  }
+
+  Temp operator+(Local lhs, Local rhs) {
+    return add(Temp(lhs), Temp(rhs));
+  }
+
+  Temp operator+(double lhs, Local rhs) {
+    return add(Temp(lhs), Temp(rhs));
+  }
+
+  Temp operator+(Local lhs, double rhs) {
+    return add(Temp(lhs), Temp(rhs));
+  }
+
+  Temp operator+(Temp lhs, Local rhs) {
+    return add(lhs, Temp(rhs));
+  }
+
+  Temp operator+(Local lhs, Temp rhs) {
+    return add(Temp(lhs), rhs);
+  }
+
+  Temp operator+(Temp lhs, double rhs) {
+    return add(lhs, Temp(rhs));
+  }
+
+  Temp operator+(double lhs, Temp rhs) {
+    return add(Temp(lhs), rhs);
+  }
+
+  Temp operator+(Temp lhs, Temp rhs) {
+    return add(lhs, rhs);
   }
 
   double operator-(Local lhs, Local rhs) {
-    Scope scope;
     return lhs->toDouble() - rhs->toDouble();
   }
 
   double operator-(double lhs, Local rhs) {
-    Scope scope;
     return lhs - rhs->toDouble();
   }
 
   double operator-(Local lhs, double rhs) {
-    Scope scope;
     return lhs->toDouble() - rhs;
   }
 
+  double operator-(Temp lhs, Local rhs) {
+    return lhs.toDouble() - rhs->toDouble();
+  }
+
+  double operator-(Local lhs, Temp rhs) {
+    return lhs->toDouble() - rhs.toDouble();
+  }
+
+  double operator-(Temp lhs, double rhs) {
+    return lhs.toDouble() - rhs;
+  }
+
+  double operator-(double lhs, Temp rhs) {
+    return lhs - rhs.toDouble();
+  }
+
+  double operator-(Temp lhs, Temp rhs) {
+    return lhs.toDouble() - rhs.toDouble();
+  }
+
   double operator*(Local lhs, Local rhs) {
-    Scope scope;
     return lhs->toDouble() * rhs->toDouble();
   }
 
   double operator*(double lhs, Local rhs) {
-    Scope scope;
     return lhs * rhs->toDouble();
   }
 
   double operator*(Local lhs, double rhs) {
-    Scope scope;
     return lhs->toDouble() * rhs;
   }
 
+  double operator*(Temp lhs, Local rhs) {
+    return lhs.toDouble() * rhs->toDouble();
+  }
+
+  double operator*(Local lhs, Temp rhs) {
+    return lhs->toDouble() * rhs.toDouble();
+  }
+
+  double operator*(Temp lhs, double rhs) {
+    return lhs.toDouble() * rhs;
+  }
+
+  double operator*(double lhs, Temp rhs) {
+    return lhs * rhs.toDouble();
+  }
+
+  double operator*(Temp lhs, Temp rhs) {
+    return lhs.toDouble() * rhs.toDouble();
+  }
+
   double operator/(Local lhs, Local rhs) {
-    Scope scope;
     return lhs->toDouble() / rhs->toDouble();
   }
 
   double operator/(double lhs, Local rhs) {
-    Scope scope;
     return lhs / rhs->toDouble();
   }
 
   double operator/(Local lhs, double rhs) {
-    Scope scope;
     return lhs->toDouble() / rhs;
   }
 
-  bool operator==(Local lhs, Local rhs) {
-    // todo move implementation?
-    return *lhs == *rhs;
+  double operator/(Temp lhs, Local rhs) {
+    return lhs.toDouble() / rhs->toDouble();
   }
 
-  bool operator<(Local lhs, Local rhs) {
-    // todo do strings compare too?
-    // todo do ints and stuff
-    Scope scope;
-    return lhs->toDouble() < rhs->toDouble();
+  double operator/(Local lhs, Temp rhs) {
+    return lhs->toDouble() / rhs.toDouble();
   }
 
-  bool operator<(Local lhs, double rhs) {
-    Scope scope;
-    return lhs->toDouble() < rhs;
+  double operator/(Temp lhs, double rhs) {
+    return lhs.toDouble() / rhs;
   }
 
-  bool operator<(double lhs, Local rhs) {
-    // todo do strings compare too?
-    // todo do ints and stuff
-    Scope scope;
-    return lhs < rhs->toDouble();
+  double operator/(double lhs, Temp rhs) {
+    return lhs / rhs.toDouble();
   }
 
-  bool operator>(Local lhs, Local rhs) {
-    Scope scope;
-    return lhs->toDouble() > rhs->toDouble();
+  double operator/(Temp lhs, Temp rhs) {
+    return lhs.toDouble() / rhs.toDouble();
   }
 
-  bool operator>(double lhs, Local rhs) {
-    Scope scope;
-    return lhs > rhs->toDouble();
+  bool operator==(Local lhs, Local rhs) {
+    return lhs->looseEquals(*rhs);
   }
 
-  bool operator>(Local lhs, double rhs) {
-    Scope scope;
-    return lhs->toDouble() > rhs;
+  // Against a number, anything but null, undefined and the reference
+  // types compares by ToNumber.
+  static bool looseEqualsNumber(const Val& aVal, double aNumber) {
+    if (aVal.isInt32()) {
+      return aVal.asInt32() == aNumber;
+    }
+    if (aVal.isNumber()) {
+      return aVal.toDouble() == aNumber;
+    }
+    if (aVal.isReference()) {
+      return false;
+    }
+    if (aVal.isNull() || aVal.isUndefined()) {
+      return false;
+    }
+    return aVal.toDouble() == aNumber;
   }
 
-  Local& operator++(Local& aLocal) {
-    // because these modify the original parameter, they do not
-    // go through ScopeRetVal::escape for the return value.
-    Scope scope;
-    aLocal = aLocal + 1;
-    return aLocal;
+  bool operator==(double lhs, Local rhs) {
+    return looseEqualsNumber(*rhs, lhs);
   }
 
-  Local& operator--(Local& aLocal) {
-    // because these modify the original parameter, they do not
-    // go through ScopeRetVal::escape for the return value.
-    Scope scope;
-    aLocal = aLocal - 1;
-    return aLocal;
+  bool operator==(Local lhs, double rhs) {
+    return looseEqualsNumber(*lhs, rhs);
   }
 
-  Local operator++(Local& aLocal, int) {
-    ScopeRetVal scope;
-    Local prev = aLocal;
-    aLocal = aLocal + 1;
-    return scope.escape(prev);
+  bool operator!=(Local lhs, Local rhs) {
+    return !lhs->looseEquals(*rhs);
   }
 
-  Local operator--(Local& aLocal, int) {
-    ScopeRetVal scope;
-    Local prev = aLocal;
-    aLocal = aLocal - 1;
-    return scope.escape(prev);
+  bool operator!=(double lhs, Local rhs) {
+    return !looseEqualsNumber(*rhs, lhs);
   }
 
-  Local& operator+=(Local& lhs, const Local& rhs)
-  {
-    Scope scope;
-    lhs = lhs + rhs;
-    return lhs;
+  bool operator!=(Local lhs, double rhs) {
+    return !looseEqualsNumber(*lhs, rhs);
   }
 
-  Local& operator-=(Local& lhs, const Local& rhs)
-  {
-    Scope scope;
-    lhs = lhs - rhs;
-    return lhs;
+  bool strictEquals(Local lhs, Local rhs) {
+    return lhs->strictEquals(*rhs);
   }
 
-  Local& operator*=(Local& lhs, const Local& rhs)
-  {
-    Scope scope;
-    lhs = lhs * rhs;
-    return lhs;
+  bool strictEquals(double lhs, Local rhs) {
+    return rhs->isNumber() && rhs->toDouble() == lhs;
   }
 
-  Local& operator/=(Local& lhs, const Local& rhs)
-  {
-    Scope scope;
-    lhs = lhs / rhs;
-    return lhs;
+  bool strictEquals(Local lhs, double rhs) {
+    return lhs->isNumber() && lhs->toDouble() == rhs;
   }
 
-  #pragma mark ArgList
+  // Relational comparison: two strings compare by contents, and anything
+  // else as numbers, so NaN always compares false.
+  template <class Compare>
+  static bool relational(const Val& lhs, const Val& rhs, Compare aCompare) {
+    if (lhs.isInt32() && rhs.isInt32()) {
+      return aCompare(lhs.asInt32(), rhs.asInt32());
+    }
+    if (lhs.isString() && rhs.isString()) {
+      return aCompare(lhs.asString().compare(rhs.asString()), 0);
+    }
+    return aCompare(lhs.toDouble(), rhs.toDouble());
+  }
 
-  ArgList::ArgList(Function& func, RawArgList args)
-  : mStackTop(engine().stackTop()),
-    mBegin(nullptr),
-    mSize(0)
-  {
+  template <class Compare>
+  static bool relational(const Temp& lhs, const Temp& rhs, Compare aCompare) {
+    // A string Temp is already rooted, so toVal() doesn't allocate.
+    if (lhs.isString() && rhs.isString()) {
+      return aCompare(lhs.toVal().asString().compare(rhs.toVal().asString()), 0);
+    }
+    return aCompare(lhs.toDouble(), rhs.toDouble());
+  }
+
+  bool operator<(Local lhs, Local rhs) {
+    return relational(*lhs, *rhs, std::less<>());
+  }
+
+  bool operator<(double lhs, Local rhs) {
+    return lhs < rhs->toDouble();
+  }
+
+  bool operator<(Local lhs, double rhs) {
+    return lhs->toDouble() < rhs;
+  }
+
+  bool operator<(Temp lhs, Local rhs) {
+    return relational(lhs, Temp(rhs), std::less<>());
+  }
+
+  bool operator<(Local lhs, Temp rhs) {
+    return relational(Temp(lhs), rhs, std::less<>());
+  }
+
+  bool operator<(Temp lhs, double rhs) {
+    return lhs.toDouble() < rhs;
+  }
+
+  bool operator<(double lhs, Temp rhs) {
+    return lhs < rhs.toDouble();
+  }
+
+  bool operator<(Temp lhs, Temp rhs) {
+    return relational(lhs, rhs, std::less<>());
+  }
+
+  bool operator>(Local lhs, Local rhs) {
+    return relational(*lhs, *rhs, std::greater<>());
+  }
+
+  bool operator>(double lhs, Local rhs) {
+    return lhs > rhs->toDouble();
+  }
+
+  bool operator>(Local lhs, double rhs) {
+    return lhs->toDouble() > rhs;
+  }
+
+  bool operator>(Temp lhs, Local rhs) {
+    return relational(lhs, Temp(rhs), std::greater<>());
+  }
+
+  bool operator>(Local lhs, Temp rhs) {
+    return relational(Temp(lhs), rhs, std::greater<>());
+  }
+
+  bool operator>(Temp lhs, double rhs) {
+    return lhs.toDouble() > rhs;
+  }
+
+  bool operator>(double lhs, Temp rhs) {
+    return lhs > rhs.toDouble();
+  }
+
+  bool operator>(Temp lhs, Temp rhs) {
+    return relational(lhs, rhs, std::greater<>());
+  }
+
+  bool operator<=(Local lhs, Local rhs) {
+    return relational(*lhs, *rhs, std::less_equal<>());
+  }
+
+  bool operator<=(double lhs, Local rhs) {
+    return lhs <= rhs->toDouble();
+  }
+
+  bool operator<=(Local lhs, double rhs) {
+    return lhs->toDouble() <= rhs;
+  }
+
+  bool operator<=(Temp lhs, Local rhs) {
+    return relational(lhs, Temp(rhs), std::less_equal<>());
+  }
+
+  bool operator<=(Local lhs, Temp rhs) {
+    return relational(Temp(lhs), rhs, std::less_equal<>());
+  }
+
+  bool operator<=(Temp lhs, double rhs) {
+    return lhs.toDouble() <= rhs;
+  }
+
+  bool operator<=(double lhs, Temp rhs) {
+    return lhs <= rhs.toDouble();
+  }
+
+  bool operator<=(Temp lhs, Temp rhs) {
+    return relational(lhs, rhs, std::less_equal<>());
+  }
+
+  bool operator>=(Local lhs, Local rhs) {
+    return relational(*lhs, *rhs, std::greater_equal<>());
+  }
+
+  bool operator>=(double lhs, Local rhs) {
+    return lhs >= rhs->toDouble();
+  }
+
+  bool operator>=(Local lhs, double rhs) {
+    return lhs->toDouble() >= rhs;
+  }
+
+  bool operator>=(Temp lhs, Local rhs) {
+    return relational(lhs, Temp(rhs), std::greater_equal<>());
+  }
+
+  bool operator>=(Local lhs, Temp rhs) {
+    return relational(Temp(lhs), rhs, std::greater_equal<>());
+  }
+
+  bool operator>=(Temp lhs, double rhs) {
+    return lhs.toDouble() >= rhs;
+  }
+
+  bool operator>=(double lhs, Temp rhs) {
+    return lhs >= rhs.toDouble();
+  }
+
+  bool operator>=(Temp lhs, Temp rhs) {
+    return relational(lhs, rhs, std::greater_equal<>());
+  }
+
+  Local& operator++(Local& aLocal) {
+    // because these modify the original parameter, they do not
+    // go through ScopeRetVal::escape for the return value.
+    int32_t a, result;
+    if (exactInt32(*aLocal, a) && addInt32(a, 1, result)) {
+      *aLocal = Val(result);
+      return aLocal;
+    }
+    aLocal = Temp(aLocal->toDouble() + 1);
+    return aLocal;
+  }
+
+  Local& operator--(Local& aLocal) {
+    // because these modify the original parameter, they do not
+    // go through ScopeRetVal::escape for the return value.
+    int32_t a, result;
+    if (exactInt32(*aLocal, a) && subInt32(a, 1, result)) {
+      *aLocal = Val(result);
+      return aLocal;
+    }
+    aLocal = Temp(aLocal->toDouble() - 1);
+    return aLocal;
+  }
+
+  // Postfix gives back the old value as a number, so there's nothing
+  // to root.
+  double operator++(Local& aLocal, int) {
+    int32_t a, result;
+    if (exactInt32(*aLocal, a) && addInt32(a, 1, result)) {
+      *aLocal = Val(result);
+      return a;
+    }
+    double prev = aLocal->toDouble();
+    aLocal = Temp(prev + 1);
+    return prev;
+  }
+
+  double operator--(Local& aLocal, int) {
+    int32_t a, result;
+    if (exactInt32(*aLocal, a) && subInt32(a, 1, result)) {
+      *aLocal = Val(result);
+      return a;
+    }
+    double prev = aLocal->toDouble();
+    aLocal = Temp(prev - 1);
+    return prev;
+  }
+
+  Local& operator+=(Local& lhs, const Local& rhs)
+  {
+    // Only here for a concatenation's temporary.
+    Scope scope;
+    lhs = lhs + rhs;
+    return lhs;
+  }
+
+  Local& operator-=(Local& lhs, const Local& rhs)
+  {
+    int32_t a, b, result;
+    if (exactInt32(*lhs, a) && exactInt32(*rhs, b) && subInt32(a, b, result)) {
+      *lhs = Val(result);
+      return lhs;
+    }
+    lhs = Temp(lhs - rhs);
+    return lhs;
+  }
+
+  Local& operator*=(Local& lhs, const Local& rhs)
+  {
+    int32_t a, b, result;
+    if (exactInt32(*lhs, a) && exactInt32(*rhs, b) && mulInt32(a, b, result)) {
+      *lhs = Val(result);
+      return lhs;
+    }
+    lhs = Temp(lhs * rhs);
+    return lhs;
+  }
+
+  Local& operator/=(Local& lhs, const Local& rhs)
+  {
+    int32_t a, b, result;
+    if (exactInt32(*lhs, a) && exactInt32(*rhs, b) && divInt32(a, b, result)) {
+      *lhs = Val(result);
+      return lhs;
+    }
+    lhs = Temp(lhs / rhs);
+    return lhs;
+  }
+
+  // The bitwise operators always produce an int32, so they return it
+  // unboxed as -, * and / do doubles. Shifts go through uint32 so a
+  // negative left operand doesn't shift into undefined behavior.
+  int32_t operator&(Local lhs, Local rhs) {
+    return lhs->toInt32() & rhs->toInt32();
+  }
+
+  int32_t operator&(double lhs, Local rhs) {
+    return toInt32(lhs) & rhs->toInt32();
+  }
+
+  int32_t operator&(Local lhs, double rhs) {
+    return lhs->toInt32() & toInt32(rhs);
+  }
+
+  int32_t operator|(Local lhs, Local rhs) {
+    return lhs->toInt32() | rhs->toInt32();
+  }
+
+  int32_t operator|(double lhs, Local rhs) {
+    return toInt32(lhs) | rhs->toInt32();
+  }
+
+  int32_t operator|(Local lhs, double rhs) {
+    return lhs->toInt32() | toInt32(rhs);
+  }
+
+  int32_t operator^(Local lhs, Local rhs) {
+    return lhs->toInt32() ^ rhs->toInt32();
+  }
+
+  int32_t operator^(double lhs, Local rhs) {
+    return toInt32(lhs) ^ rhs->toInt32();
+  }
+
+  int32_t operator^(Local lhs, double rhs) {
+    return lhs->toInt32() ^ toInt32(rhs);
+  }
+
+  int32_t operator~(Local aLocal) {
+    return ~aLocal->toInt32();
+  }
+
+  static int32_t shiftLeft(int32_t aLhs, uint32_t aRhs) {
+    return static_cast<int32_t>(static_cast<uint32_t>(aLhs) << (aRhs & 31));
+  }
+
+  static int32_t shiftRight(int32_t aLhs, uint32_t aRhs) {
+    // Arithmetic shift of a negative is implementation-defined rather
+    // than undefined, and every compiler we target sign-extends.
+    return aLhs >> (aRhs & 31);
+  }
+
+  int32_t operator<<(Local lhs, Local rhs) {
+    return shiftLeft(lhs->toInt32(), rhs->toUint32());
+  }
+
+  int32_t operator<<(double lhs, Local rhs) {
+    return shiftLeft(toInt32(lhs), rhs->toUint32());
+  }
+
+  int32_t operator<<(Local lhs, double rhs) {
+    return shiftLeft(lhs->toInt32(), toUint32(rhs));
+  }
+
+  int32_t operator>>(Local lhs, Local rhs) {
+    return shiftRight(lhs->toInt32(), rhs->toUint32());
+  }
+
+  int32_t operator>>(double lhs, Local rhs) {
+    return shiftRight(toInt32(lhs), rhs->toUint32());
+  }
+
+  int32_t operator>>(Local lhs, double rhs) {
+    return shiftRight(lhs->toInt32(), toUint32(rhs));
+  }
+
+  double unsignedShiftRight(Local lhs, Local rhs) {
+    return lhs->toUint32() >> (rhs->toUint32() & 31);
+  }
+
+  double unsignedShiftRight(double lhs, Local rhs) {
+    return toUint32(lhs) >> (rhs->toUint32() & 31);
+  }
+
+  double unsignedShiftRight(Local lhs, double rhs) {
+    return lhs->toUint32() >> (toUint32(rhs) & 31);
+  }
+
+  Local& operator&=(Local& lhs, const Local& rhs) {
+    *lhs = Val(lhs->toInt32() & rhs->toInt32());
+    return lhs;
+  }
+
+  Local& operator|=(Local& lhs, const Local& rhs) {
+    *lhs = Val(lhs->toInt32() | rhs->toInt32());
+    return lhs;
+  }
+
+  Local& operator^=(Local& lhs, const Local& rhs) {
+    *lhs = Val(lhs->toInt32() ^ rhs->toInt32());
+    return lhs;
+  }
+
+  Local& operator<<=(Local& lhs, const Local& rhs) {
+    *lhs = Val(shiftLeft(lhs->toInt32(), rhs->toUint32()));
+    return lhs;
+  }
+
+  Local& operator>>=(Local& lhs, const Local& rhs) {
+    *lhs = Val(shiftRight(lhs->toInt32(), rhs->toUint32()));
+    return lhs;
+  }
+
+  #pragma mark ArgList
+
+  ArgList::ArgList(Function& func, RawArgList args)
+  : mStackTop(engine().stackTop()),
+    mBegin(nullptr),
+    mSize(0)
+  {
     // Copy all the temporaries passed in to a lower scope
     size_t size = 0;
     for (auto& local : args) {
@@ -388,8 +1390,76 @@ namespace AotJS {
     //
   }
 
-  void GCThing::markRefsForGC() {
-    // no-op default
+  void* GCThing::operator new(size_t aSize) {
+    return engine().allocateForGC(aSize);
+  }
+
+  void GCThing::operator delete(void* aPtr) {
+    // Only reached if a constructor bails out; the sweeper destroys
+    // objects in place and recycles their cells itself.
+    engine().freeForGC(aPtr);
+  }
+
+  void* GCThing::allocateTenured(size_t aSize) {
+    #ifdef FORCE_GC
+    engine().gc();
+    #endif
+    return engine().allocatePinnedForGC(aSize);
+  }
+
+  void GCThing::traceRefsForGC(GCTracer& aTracer) {
+    switch (mKind) {
+      case GCKind::Cell:
+        static_cast<Cell*>(this)->traceRefs(aTracer);
+        break;
+      case GCKind::Object:
+        static_cast<Object*>(this)->traceRefs(aTracer);
+        break;
+      case GCKind::Function:
+        static_cast<Function*>(this)->traceRefs(aTracer);
+        break;
+      case GCKind::String:
+        static_cast<String*>(this)->traceRefs(aTracer);
+        break;
+      default:
+        // Nothing else holds references.
+        break;
+    }
+  }
+
+  void GCThing::finalizeForGC() {
+    switch (mKind) {
+      case GCKind::BoxDouble:
+      case GCKind::BoxInt32:
+      case GCKind::Cell:
+        // Trivially destructible.
+        break;
+      case GCKind::String:
+        // Only a flattened Rope has anything to free.
+        if (static_cast<String*>(this)->isRope()) {
+          static_cast<Rope*>(this)->Rope::~Rope();
+        }
+        break;
+      case GCKind::Symbol:
+        static_cast<Symbol*>(this)->Symbol::~Symbol();
+        break;
+      case GCKind::Object:
+        static_cast<Object*>(this)->Object::~Object();
+        break;
+      case GCKind::Function:
+        static_cast<Function*>(this)->Function::~Function();
+        break;
+      default:
+        this->~GCThing();
+        break;
+    }
+  }
+
+  GCThing* GCThing::relocateForGC(void*) {
+    #ifdef DEBUG
+    std::cerr << "cannot relocate " << typeOf() << "\n";
+    #endif
+    std::abort();
   }
 
   string GCThing::dump() {
@@ -400,304 +1470,2218 @@ namespace AotJS {
     ScopeRet<String> scope;
     std::ostringstream buf;
     buf << "[" << typeOf() << "]";
-    return scope.escape(retain<String>(buf.str()));
+    return scope.escape(String::create(buf.str()));
   }
 
   int32_t GCThing::toInt32() const {
-    return 0;
+    switch (mKind) {
+      case GCKind::BoxDouble:
+        return AotJS::toInt32(static_cast<const Box<double>*>(this)->val());
+      case GCKind::BoxInt32:
+        return static_cast<const Box<int32_t>*>(this)->val();
+      default:
+        return 0;
+    }
   }
 
   double GCThing::toDouble() const {
-    return NAN;
+    switch (mKind) {
+      case GCKind::BoxDouble:
+        return static_cast<const Box<double>*>(this)->val();
+      case GCKind::BoxInt32:
+        return static_cast<const Box<int32_t>*>(this)->val();
+      case GCKind::String:
+        return static_cast<const String*>(this)->toNumber();
+      default:
+        return NAN;
+    }
   }
 
   TypeOf GCThing::typeOf() const {
-    return typeOfGCThing;
+    return typeOfKind[static_cast<size_t>(mKind)];
   }
 
   #pragma mark Box
 
-  template <>
-  TypeOf Box<double>::typeOf() const {
-    return typeOfBoxDouble;
+  template<class T>
+  string Box<T>::dump() {
+    char chars[maxNumberLength];
+    return string(chars, numberToString(val(), chars));
+  };
+
+  template class Box<double>;
+  template class Box<int32_t>;
+
+  #pragma mark Object
+
+  Object::~Object() {
+    //
+  }
+
+  // todo: handle numeric indices
+  // todo: getters
+  Local Object::getProp(Local aObj, Local aName) {
+    PropIndex* key;
+    if (aName->isSymbol()) {
+      key = &aName->asSymbol();
+    } else if (aName->isString()) {
+      // A name that was never interned can't be any object's key.
+      key = engine().findAtom(aName->asString());
+      if (!key) {
+        return Local(Undefined());
+      }
+    } else {
+      ScopeRetVal scope;
+      Local name = aName->toString();
+      return scope.escape(getProp(aObj, name));
+    }
+    for (Object* obj = &aObj->asObject(); obj; obj = obj->mPrototype) {
+      auto iter = obj->mProps.find(key);
+      if (iter != obj->mProps.end()) {
+        return Local(iter->second);
+      }
+    }
+    return Local(Undefined());
+  }
+
+  void Object::setProp(Local aObj, Local aName, Local aVal) {
+    Scope scope;
+    PropIndex* key;
+    if (aName->isSymbol()) {
+      key = &aName->asSymbol();
+      // Compaction would move it out from under the map.
+      engine().pinForGC(*key);
+    } else if (aName->isString()) {
+      key = engine().atomize(aName);
+    } else {
+      key = engine().atomize(aName->toString());
+    }
+    // Interning the key can GC and move the object out of the nursery.
+    Object& obj = aObj->asObject();
+    obj.mProps[key] = *aVal;
+    engine().writeBarrier(obj, key);
+    engine().writeBarrier(obj, *aVal);
+  }
+
+  GCThing* Object::relocateForGC(void* aDest) {
+    return ::new (aDest) Object(std::move(*this));
   }
 
-  template <>
-  TypeOf Box<int32_t>::typeOf() const {
-    return typeOfBoxInt32;
+  void Object::traceRefs(GCTracer& aTracer) {
+    aTracer.traceThing(mPrototype);
+    for (auto& iter : mProps) {
+      // Keys are pinned, so this only ever marks them.
+      PropIndex* key = iter.first;
+      aTracer.traceThing(key);
+      aTracer.trace(iter.second);
+    }
   }
 
-  template <>
-  TypeOf Box<Undefined>::typeOf() const {
-    return typeOfUndefined;
+  string Object::dump() {
+    std::ostringstream buf;
+    buf << "Object({";
+
+    bool first = true;
+    for (auto iter : mProps) {
+      auto name = iter.first;
+      auto val = iter.second;
+
+      if (first) {
+        first = false;
+      } else {
+        buf << ",";
+      }
+      buf << name->dump();
+      buf << ":";
+      buf << val.dump();
+    }
+    buf << "})";
+    return buf.str();
   }
 
-  template <>
-  TypeOf Box<Null>::typeOf() const {
-    return typeOfNull;
+  #pragma mark PropIndex
+  PropIndex::~PropIndex() {
+    //
   }
 
-  template <>
-  TypeOf Box<bool>::typeOf() const {
-    return typeOfBoolean;
-  }
+  #pragma mark String
+
+  // Copy aLength code units between Latin-1 and UTF-16 buffers, either way.
+  static void copyUnits(const void* aSrc, bool aSrcTwoByte,
+    void* aDest, bool aDestTwoByte, size_t aLength)
+  {
+    if (aSrcTwoByte == aDestTwoByte) {
+      std::memcpy(aDest, aSrc, aSrcTwoByte ? 2 * aLength : aLength);
+    } else if (aDestTwoByte) {
+      const uint8_t* src = static_cast<const uint8_t*>(aSrc);
+      char16_t* dest = static_cast<char16_t*>(aDest);
+      for (size_t i = 0; i < aLength; i++) {
+        dest[i] = src[i];
+      }
+    } else {
+      const char16_t* src = static_cast<const char16_t*>(aSrc);
+      uint8_t* dest = static_cast<uint8_t*>(aDest);
+      for (size_t i = 0; i < aLength; i++) {
+        dest[i] = static_cast<uint8_t>(src[i]);
+      }
+    }
+  }
+
+  static bool fitsLatin1(const char16_t* aUnits, size_t aLength) {
+    for (size_t i = 0; i < aLength; i++) {
+      if (aUnits[i] > 0xff) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <class L, class R>
+  static int compareUnits(const L* aLhs, const R* aRhs, size_t aLength) {
+    for (size_t i = 0; i < aLength; i++) {
+      if (aLhs[i] != aRhs[i]) {
+        return aLhs[i] < aRhs[i] ? -1 : 1;
+      }
+    }
+    return 0;
+  }
+
+  static int compareUnits(const void* aLhs, bool aLhsTwoByte,
+    const void* aRhs, bool aRhsTwoByte, size_t aLength)
+  {
+    if (!aLhsTwoByte && !aRhsTwoByte) {
+      return std::memcmp(aLhs, aRhs, aLength);
+    }
+    if (!aLhsTwoByte) {
+      return compareUnits(static_cast<const uint8_t*>(aLhs), static_cast<const char16_t*>(aRhs), aLength);
+    }
+    if (!aRhsTwoByte) {
+      return compareUnits(static_cast<const char16_t*>(aLhs), static_cast<const uint8_t*>(aRhs), aLength);
+    }
+    return compareUnits(static_cast<const char16_t*>(aLhs), static_cast<const char16_t*>(aRhs), aLength);
+  }
+
+  template <class T>
+  static uint32_t hashUnits(const T* aUnits, size_t aLength) {
+    // FNV-1a, a unit at a time.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < aLength; i++) {
+      hash = (hash ^ aUnits[i]) * 16777619u;
+    }
+    // 0 means not computed yet.
+    return hash ? hash : 1;
+  }
+
+  template <class T>
+  static string encodeUtf8(const T* aUnits, size_t aLength) {
+    string out;
+    out.reserve(aLength);
+    for (size_t i = 0; i < aLength; i++) {
+      uint32_t c = aUnits[i];
+      if (c >= 0xd800 && c <= 0xdfff) {
+        if (c <= 0xdbff && i + 1 < aLength && aUnits[i + 1] >= 0xdc00 && aUnits[i + 1] <= 0xdfff) {
+          c = 0x10000 + ((c - 0xd800) << 10) + (aUnits[++i] - 0xdc00);
+        } else {
+          c = 0xfffd;
+        }
+      }
+      if (c < 0x80) {
+        out += static_cast<char>(c);
+      } else if (c < 0x800) {
+        out += static_cast<char>(0xc0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+      } else if (c < 0x10000) {
+        out += static_cast<char>(0xe0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+      } else {
+        out += static_cast<char>(0xf0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (c & 0x3f));
+      }
+    }
+    return out;
+  }
+
+  // WhiteSpace and LineTerminator, which trim() and ToNumber skip.
+  static bool isWhitespaceUnit(char16_t c) {
+    switch (c) {
+      case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d: case 0x20:
+      case 0xa0: case 0x1680: case 0x2028: case 0x2029: case 0x202f:
+      case 0x205f: case 0x3000: case 0xfeff:
+        return true;
+      default:
+        return c >= 0x2000 && c <= 0x200a;
+    }
+  }
+
+  static void checkLength(size_t aLength) {
+    if (aLength > String::maxLength) {
+      #ifdef DEBUG
+      std::cerr << "invalid string length " << aLength << "\n";
+      #endif
+      std::abort();
+    }
+  }
+
+  String::String(size_t aLength, bool aTwoByte, Shape aShape)
+  : PropIndex(GCKind::String),
+    mAtom(false),
+    mTwoByte(aTwoByte),
+    mShape(aShape),
+    mLength(static_cast<uint32_t>(aLength)),
+    mHash(0)
+  {
+    //
+  }
+
+  String::~String() {
+    //
+  }
+
+  String* String::allocate(size_t aLength, bool aTwoByte, bool aTenured) {
+    checkLength(aLength);
+    size_t unit = aTwoByte ? 2 : 1;
+    size_t size = sizeof(String) + (aLength + 1) * unit;
+    void* cell = aTenured ? allocateTenured(size) : GCThing::operator new(size);
+    String* str = ::new (cell) String(aLength, aTwoByte, Shape::Flat);
+    std::memset(static_cast<uint8_t*>(str->buffer()) + aLength * unit, 0, unit);
+    return str;
+  }
+
+  String* String::create(const char* aChars, size_t aLength) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(aChars);
+    size_t ascii = 0;
+    while (ascii < aLength && bytes[ascii] < 0x80) {
+      ascii++;
+    }
+    if (ascii == aLength) {
+      // Plain ASCII, the usual case, is Latin-1 already.
+      String* str = allocate(aLength, false, false);
+      std::memcpy(str->buffer(), aChars, aLength);
+      return str;
+    }
+
+    std::vector<char16_t> units(bytes, bytes + ascii);
+    units.reserve(aLength);
+    for (size_t i = ascii; i < aLength;) {
+      uint32_t c = bytes[i];
+      size_t count = 0;
+      uint32_t min = 0;
+      if (c < 0x80) {
+        count = 1;
+      } else if ((c & 0xe0) == 0xc0) {
+        count = 2;
+        c &= 0x1f;
+        min = 0x80;
+      } else if ((c & 0xf0) == 0xe0) {
+        count = 3;
+        c &= 0x0f;
+        min = 0x800;
+      } else if ((c & 0xf8) == 0xf0) {
+        count = 4;
+        c &= 0x07;
+        min = 0x10000;
+      }
+      size_t seen = 1;
+      while (seen < count && i + seen < aLength && (bytes[i + seen] & 0xc0) == 0x80) {
+        c = (c << 6) | (bytes[i + seen] & 0x3f);
+        seen++;
+      }
+      if (!count || seen < count || c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+        // Replace the lead byte, and try again from the next one.
+        units.push_back(0xfffd);
+        i++;
+        continue;
+      }
+      if (c >= 0x10000) {
+        c -= 0x10000;
+        units.push_back(static_cast<char16_t>(0xd800 + (c >> 10)));
+        units.push_back(static_cast<char16_t>(0xdc00 + (c & 0x3ff)));
+      } else {
+        units.push_back(static_cast<char16_t>(c));
+      }
+      i += count;
+    }
+    return create(units.data(), units.size());
+  }
+
+  String* String::create(const char16_t* aUnits, size_t aLength) {
+    bool twoByte = !fitsLatin1(aUnits, aLength);
+    String* str = allocate(aLength, twoByte, false);
+    copyUnits(aUnits, true, str->buffer(), twoByte, aLength);
+    return str;
+  }
+
+  static uint32_t ropeDepth(const String& aString) {
+    return aString.isRope() ? static_cast<const Rope&>(aString).depth() : 0;
+  }
+
+  Retained<String> String::concat(Local aLhs, Local aRhs) {
+    ScopeRet<String> scope;
+    size_t lhsLength = aLhs->asString().length();
+    size_t rhsLength = aRhs->asString().length();
+    // Strings are immutable, so either side will do as it is.
+    if (rhsLength == 0) {
+      return scope.escape(&aLhs->asString());
+    }
+    if (lhsLength == 0) {
+      return scope.escape(&aRhs->asString());
+    }
+
+    size_t length = lhsLength + rhsLength;
+    checkLength(length);
+    uint32_t depth = 1 + std::max(ropeDepth(aLhs->asString()), ropeDepth(aRhs->asString()));
+    if (length >= Rope::minLength && depth <= Rope::maxDepth) {
+      // Construct in place, so the halves are read after allocating.
+      void* cell = GCThing::operator new(sizeof(Rope));
+      return scope.escape(::new (cell) Rope(aLhs->asString(), aRhs->asString(), depth));
+    }
+
+    // Short, or deep enough that it's time to pay for the copy.
+    bool twoByte = aLhs->asString().isTwoByte() || aRhs->asString().isTwoByte();
+    String* joined = allocate(length, twoByte, false);
+    // Read both sides after allocating, which may have moved them.
+    uint8_t* dest = static_cast<uint8_t*>(joined->buffer());
+    aLhs->asString().copyChars(dest, twoByte);
+    aRhs->asString().copyChars(dest + (twoByte ? 2 * lhsLength : lhsLength), twoByte);
+    return scope.escape(joined);
+  }
+
+  Retained<String> String::range(Local aString, size_t aStart, size_t aLength) {
+    ScopeRet<String> scope;
+    size_t parentLength = aString->asString().length();
+    if (aLength == parentLength) {
+      return scope.escape(&aString->asString());
+    }
+    if (aLength < Slice::minLength ||
+        (aLength <= Slice::maxCopyLength && aLength * Slice::maxWaste < parentLength)) {
+      // Narrow the copy to Latin-1 if this part fits.
+      const String& source = aString->asString();
+      bool twoByte = source.isTwoByte() && !fitsLatin1(source.twoByteChars() + aStart, aLength);
+      String* copy = allocate(aLength, twoByte, false);
+      // Read the source after allocating, which may have moved it.
+      const String& moved = aString->asString();
+      const uint8_t* chars = static_cast<const uint8_t*>(moved.rawChars());
+      copyUnits(chars + (moved.isTwoByte() ? 2 * aStart : aStart), moved.isTwoByte(),
+        copy->buffer(), twoByte, aLength);
+      return scope.escape(copy);
+    }
+
+    // Share the characters of whatever actually holds them.
+    String* parent = &aString->asString();
+    if (parent->isSlice()) {
+      Slice* slice = static_cast<Slice*>(parent);
+      aStart += slice->mOffset;
+      parent = slice->mParent;
+    }
+    // Doesn't allocate on the GC heap; settles where a Rope's chars are.
+    parent->rawChars();
+    Local parentVal(parent);
+    void* cell = GCThing::operator new(sizeof(Slice));
+    return scope.escape(::new (cell) Slice(parentVal->asString(), aStart, aLength));
+  }
+
+  // ToIntegerOrInfinity, clamped to [0, aLength].
+  static size_t clampIndex(double aIndex, size_t aLength) {
+    if (!(aIndex > 0)) {
+      // Including NaN.
+      return 0;
+    }
+    return aIndex < aLength ? static_cast<size_t>(aIndex) : aLength;
+  }
+
+  Retained<String> String::substring(Local aString, double aStart, double aEnd) {
+    size_t length = aString->asString().length();
+    size_t start = clampIndex(aStart, length);
+    size_t end = clampIndex(aEnd, length);
+    if (start > end) {
+      std::swap(start, end);
+    }
+    return range(aString, start, end - start);
+  }
+
+  Retained<String> String::slice(Local aString, double aStart, double aEnd) {
+    // Negative offsets count back from the end.
+    double length = aString->asString().length();
+    size_t start = clampIndex(aStart < 0 ? length + std::trunc(aStart) : aStart, length);
+    size_t end = clampIndex(aEnd < 0 ? length + std::trunc(aEnd) : aEnd, length);
+    return range(aString, start, end > start ? end - start : 0);
+  }
+
+  Retained<String> String::trim(Local aString) {
+    const String& str = aString->asString();
+    size_t start = 0;
+    size_t end = str.length();
+    while (start < end && isWhitespaceUnit(str.charCodeAt(start))) {
+      start++;
+    }
+    while (end > start && isWhitespaceUnit(str.charCodeAt(end - 1))) {
+      end--;
+    }
+    return range(aString, start, end - start);
+  }
+
+  Retained<String> String::charAt(Local aString, size_t aIndex) {
+    if (aIndex >= aString->asString().length()) {
+      return range(aString, 0, 0);
+    }
+    return range(aString, aIndex, 1);
+  }
+
+  const void* String::flatChars() const {
+    if (isSlice()) {
+      return static_cast<const Slice*>(this)->sliceChars();
+    }
+    return static_cast<const Rope*>(this)->flatten();
+  }
+
+  void String::copyChars(void* aDest, bool aTwoByte) const {
+    if (isRope()) {
+      const Rope* rope = static_cast<const Rope*>(this);
+      if (!rope->mFlat) {
+        size_t leftLength = rope->mLeft->length();
+        rope->mLeft->copyChars(aDest, aTwoByte);
+        rope->mRight->copyChars(static_cast<uint8_t*>(aDest) + (aTwoByte ? 2 * leftLength : leftLength), aTwoByte);
+        return;
+      }
+    }
+    copyUnits(rawChars(), mTwoByte, aDest, aTwoByte, mLength);
+  }
+
+  void String::traceRefs(GCTracer& aTracer) {
+    if (isRope()) {
+      static_cast<Rope*>(this)->traceRefs(aTracer);
+    } else if (isSlice()) {
+      static_cast<Slice*>(this)->traceRefs(aTracer);
+    }
+  }
+
+  uint32_t String::computeHash() const {
+    // Latin-1 and UTF-16 copies of the same units hash the same.
+    if (mTwoByte) {
+      return hashUnits(twoByteChars(), mLength);
+    }
+    return hashUnits(latin1Chars(), mLength);
+  }
+
+  bool String::equalUnits(const void* aLhs, bool aLhsTwoByte,
+    const void* aRhs, bool aRhsTwoByte, size_t aLength)
+  {
+    if (aLhsTwoByte == aRhsTwoByte) {
+      return std::memcmp(aLhs, aRhs, aLhsTwoByte ? 2 * aLength : aLength) == 0;
+    }
+    return compareUnits(aLhs, aLhsTwoByte, aRhs, aRhsTwoByte, aLength) == 0;
+  }
+
+  bool String::equalChars(const String& rhs) const {
+    return equalUnits(rawChars(), mTwoByte, rhs.rawChars(), rhs.mTwoByte, mLength);
+  }
+
+  int String::compare(const String& rhs) const {
+    size_t common = mLength < rhs.mLength ? mLength : rhs.mLength;
+    int result = compareUnits(rawChars(), mTwoByte, rhs.rawChars(), rhs.mTwoByte, common);
+    if (result) {
+      return result;
+    }
+    return mLength < rhs.mLength ? -1 : (mLength > rhs.mLength ? 1 : 0);
+  }
+
+  String* String::tenuredCopy() const {
+    // Allocating may move us.
+    Scope scope;
+    Local self(this);
+    String* copy = allocate(mLength, mTwoByte, true);
+    const String& original = self->asString();
+    original.copyChars(copy->buffer(), copy->mTwoByte);
+    copy->mHash = original.mHash;
+    return copy;
+  }
+
+  GCThing* String::relocateForGC(void* aDest) {
+    String* copy = ::new (aDest) String(std::move(*this));
+    std::memcpy(copy->buffer(), rawChars(), (mLength + 1) * (mTwoByte ? 2 : 1));
+    return copy;
+  }
+
+  double String::toNumber() const {
+    // Only ASCII makes a number, once any whitespace is off the ends.
+    size_t start = 0;
+    size_t end = mLength;
+    while (start < end && isWhitespaceUnit(charCodeAt(start))) {
+      start++;
+    }
+    while (end > start && isWhitespaceUnit(charCodeAt(end - 1))) {
+      end--;
+    }
+    if (!mTwoByte) {
+      return stringToNumber(reinterpret_cast<const char*>(latin1Chars()) + start, end - start);
+    }
+    string ascii;
+    ascii.reserve(end - start);
+    for (size_t i = start; i < end; i++) {
+      char16_t c = charCodeAt(i);
+      if (c >= 0x80) {
+        return NAN;
+      }
+      ascii += static_cast<char>(c);
+    }
+    return stringToNumber(ascii.data(), ascii.size());
+  }
+
+  string String::str() const {
+    if (mTwoByte) {
+      return encodeUtf8(twoByteChars(), mLength);
+    }
+    return encodeUtf8(latin1Chars(), mLength);
+  }
+
+  string String::dump() {
+    // todo: emit JSON or something
+    std::ostringstream buf;
+    // Copy rather than flatten, so dumping never changes anything.
+    std::vector<char16_t> units(mLength);
+    copyChars(units.data(), true);
+    buf << "\"";
+    buf << encodeUtf8(units.data(), mLength);
+    buf << "\"";
+    return buf.str();
+  }
+
+  #pragma mark Rope
+
+  Rope::Rope(String& aLeft, String& aRight, uint32_t aDepth)
+  : String(aLeft.length() + aRight.length(), aLeft.isTwoByte() || aRight.isTwoByte(), Shape::Rope),
+    mLeft(&aLeft),
+    mRight(&aRight),
+    mFlat(nullptr),
+    mDepth(aDepth)
+  {
+    // We may have gone straight into the tenured heap.
+    engine().writeBarrier(*this, mLeft);
+    engine().writeBarrier(*this, mRight);
+  }
+
+  Rope::Rope(Rope&& aOther)
+  : String(std::move(aOther)),
+    mLeft(aOther.mLeft),
+    mRight(aOther.mRight),
+    mFlat(aOther.mFlat),
+    mDepth(aOther.mDepth)
+  {
+    // The original gets finalized once it's moved; the buffer is ours now.
+    aOther.mFlat = nullptr;
+  }
+
+  Rope::~Rope() {
+    std::free(mFlat);
+  }
+
+  GCThing* Rope::relocateForGC(void* aDest) {
+    return ::new (aDest) Rope(std::move(*this));
+  }
+
+  void Rope::traceRefs(GCTracer& aTracer) {
+    aTracer.traceThing(mLeft);
+    aTracer.traceThing(mRight);
+  }
+
+  const void* Rope::flatten() const {
+    if (!mFlat) {
+      // Nothing here touches the GC heap, so callers can hold on to
+      // references to other things across it.
+      size_t unit = isTwoByte() ? 2 : 1;
+      uint8_t* flat = static_cast<uint8_t*>(std::malloc((length() + 1) * unit));
+      if (!flat) {
+        #ifdef DEBUG
+        std::cerr << "out of memory flattening rope\n";
+        #endif
+        std::abort();
+      }
+      copyChars(flat, isTwoByte());
+      std::memset(flat + length() * unit, 0, unit);
+      mFlat = flat;
+      // The halves may be garbage now. Dropping references needs no
+      // barrier, as marking only has to find what's still stored.
+      mLeft = nullptr;
+      mRight = nullptr;
+    }
+    return mFlat;
+  }
+
+  #pragma mark Slice
+
+  Slice::Slice(String& aParent, size_t aOffset, size_t aLength)
+  : String(aLength, aParent.isTwoByte(), Shape::Slice),
+    mParent(&aParent),
+    mOffset(static_cast<uint32_t>(aOffset))
+  {
+    // We may have gone straight into the tenured heap.
+    engine().writeBarrier(*this, mParent);
+  }
+
+  GCThing* Slice::relocateForGC(void* aDest) {
+    return ::new (aDest) Slice(std::move(*this));
+  }
+
+  void Slice::traceRefs(GCTracer& aTracer) {
+    aTracer.traceThing(mParent);
+  }
+
+  #pragma mark Symbol
+
+  Symbol::~Symbol() {
+    //
+  }
+
+  GCThing* Symbol::relocateForGC(void* aDest) {
+    return ::new (aDest) Symbol(std::move(*this));
+  }
+
+  string Symbol::dump() {
+    std::ostringstream buf;
+    buf << "Symbol(\"";
+    buf << name;
+    buf << "\")";
+    return buf.str();
+  }
+
+  #pragma mark Internal
+
+  Internal::~Internal() {
+    //
+  }
+
+  #pragma mark JSThing
+
+  JSThing::~JSThing() {
+    //
+  }
+
+  Retained<String> JSThing::toString() const {
+    ScopeRet<String> scope;
+    return scope.escape(String::create("[jsthing JSThing]"));
+  }
+
+  #pragma mark Cell
+
+  Cell::~Cell() {
+    //
+  }
+
+  GCThing* Cell::relocateForGC(void* aDest) {
+    return ::new (aDest) Cell(std::move(*this));
+  }
+
+  void Cell::traceRefs(GCTracer& aTracer) {
+    aTracer.trace(mVal);
+  }
+
+  string Cell::dump() {
+    std::ostringstream buf;
+    buf << "Cell(" << mVal.dump() << ")";
+    return buf.str();
+  }
+
+  #pragma mark Function
+
+  Function::~Function() {
+    //
+  }
+
+  GCThing* Function::relocateForGC(void* aDest) {
+    return ::new (aDest) Function(std::move(*this));
+  }
+
+  void Function::traceRefs(GCTracer& aTracer) {
+    // Our own properties, then the captured variables.
+    Object::traceRefs(aTracer);
+    for (auto& cell : mCaptures) {
+      aTracer.traceThing(cell);
+    }
+  }
+
+
+  Local Function::call(Local aThis, RawArgList aArgs) {
+    ScopeRetVal scope;
+    return scope.escape(*mBody(*this, aThis, ArgList(*this, aArgs)));
+  }
+
+  string Function::dump() {
+    std::ostringstream buf;
+    buf << "Function(\"" << name() << "\")";
+    return buf.str();
+  }
+
+  #pragma mark Heap
+
+  size_t Arena::headerSize() {
+    return (sizeof(Arena) + granuleSize - 1) & ~(granuleSize - 1);
+  }
+
+  #ifdef VAL_COMPRESSED
+
+  uintptr_t Heap::cageBase = 0;
+
+  // Unused ranges of the cage, as offset -> size, merged with their
+  // neighbours as they're given back. Large arenas are released on the
+  // finalizer thread, hence the lock.
+  static std::map<uint64_t, uint64_t> cageFree;
+  #ifdef AOTJS_THREADS
+  static std::mutex cageLock;
+  #endif
+
+  static void reserveCage() {
+    // Only address space for now; pages are made accessible as they're
+    // handed out. Chunk-aligned, so aligning offsets aligns addresses.
+    size_t padded = Heap::cageSize + Chunk::size;
+    void* mem = mmap(nullptr, padded, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      #ifdef DEBUG
+      std::cerr << "out of memory reserving heap cage\n";
+      #endif
+      std::abort();
+    }
+    uintptr_t begin = reinterpret_cast<uintptr_t>(mem);
+    uintptr_t aligned = (begin + Chunk::size - 1) & ~(Chunk::size - 1);
+    if (aligned > begin) {
+      munmap(mem, aligned - begin);
+    }
+    munmap(reinterpret_cast<void*>(aligned + Heap::cageSize), begin + padded - (aligned + Heap::cageSize));
+    Heap::cageBase = aligned;
+
+    // Offset 0 is never handed out.
+    cageFree[uint64_t(Arena::size)] = Heap::cageSize - Arena::size;
+  }
+
+  static void* cageAllocate(size_t aSize, size_t aAlign) {
+    #ifdef AOTJS_THREADS
+    std::lock_guard<std::mutex> lock(cageLock);
+    #endif
+    for (auto iter = cageFree.begin(); iter != cageFree.end(); iter++) {
+      uint64_t begin = iter->first;
+      uint64_t end = begin + iter->second;
+      uint64_t aligned = (begin + aAlign - 1) & ~uint64_t(aAlign - 1);
+      if (aligned + aSize > end) {
+        continue;
+      }
+      cageFree.erase(iter);
+      if (aligned > begin) {
+        cageFree[begin] = aligned - begin;
+      }
+      if (aligned + aSize < end) {
+        cageFree[aligned + aSize] = end - (aligned + aSize);
+      }
+      void* mem = reinterpret_cast<void*>(Heap::cageBase + aligned);
+      mprotect(mem, aSize, PROT_READ | PROT_WRITE);
+      return mem;
+    }
+    return nullptr;
+  }
+
+  static void cageRelease(void* aMem, size_t aSize) {
+    madvise(aMem, aSize, MADV_DONTNEED);
+    mprotect(aMem, aSize, PROT_NONE);
+    #ifdef AOTJS_THREADS
+    std::lock_guard<std::mutex> lock(cageLock);
+    #endif
+    uint64_t begin = reinterpret_cast<uintptr_t>(aMem) - Heap::cageBase;
+    uint64_t size = aSize;
+    auto next = cageFree.lower_bound(begin);
+    if (next != cageFree.end() && next->first == begin + size) {
+      size += next->second;
+      next = cageFree.erase(next);
+    }
+    if (next != cageFree.begin()) {
+      auto prev = std::prev(next);
+      if (prev->first + prev->second == begin) {
+        prev->second += size;
+        return;
+      }
+    }
+    cageFree[begin] = size;
+  }
+
+  #endif
+
+  Heap::Heap()
+  : mLargeArenas(nullptr),
+    mLargeSweepQueue(nullptr),
+    mChunks(nullptr),
+    mRetainedBytes(Engine::defaultRetainedBytes)
+    #ifdef AOTJS_THREADS
+    ,
+    mBackgroundFinalization(false),
+    mFinalizerBusy(false),
+    mFinalizerStop(false),
+    mFinalizeQueue(nullptr),
+    mFinalized(nullptr)
+    #endif
+  {
+    for (size_t i = 0; i < sizeClassCount; i++) {
+      size_t cellSize = i < 16
+        ? (i + 1) * Arena::granuleSize
+        : (17 + (i - 16) * 4 + 3) * Arena::granuleSize;
+      mSizeClasses[i] = SizeClass { cellSize, nullptr, nullptr, nullptr };
+    }
+    #ifdef VAL_COMPRESSED
+    if (!cageBase) {
+      reserveCage();
+    }
+    #endif
+  }
+
+  Heap::~Heap() {
+    setBackgroundFinalization(false);
+    finishSweeping();
+
+    // Run finalizers on anything still alive and give back the memory.
+    forEach([] (GCThing* obj) {
+      obj->finalizeForGC();
+    });
+    for (auto& sizeClass : mSizeClasses) {
+      Arena* arena = sizeClass.mArenas;
+      while (arena) {
+        Arena* next = arena->mNext;
+        releaseArena(arena);
+        arena = next;
+      }
+    }
+    Arena* arena = mLargeArenas;
+    while (arena) {
+      Arena* next = arena->mNext;
+      releaseArena(arena);
+      arena = next;
+    }
+    while (Chunk* chunk = mChunks) {
+      mChunks = chunk->mNext;
+      releaseChunk(chunk);
+    }
+  }
+
+  // Memory straight from the system, aligned to aAlign.
+  static void* mapMemory(size_t aSize, size_t aAlign) {
+    #if defined(VAL_COMPRESSED)
+    return cageAllocate(aSize, aAlign);
+    #elif defined(AOTJS_MMAP)
+    // Map enough to find an aligned range inside, then trim the ends.
+    size_t padded = aSize + (aAlign > Arena::size ? aAlign : 0);
+    void* mem = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      return nullptr;
+    }
+    uintptr_t begin = reinterpret_cast<uintptr_t>(mem);
+    uintptr_t aligned = (begin + aAlign - 1) & ~(aAlign - 1);
+    if (aligned > begin) {
+      munmap(mem, aligned - begin);
+    }
+    if (begin + padded > aligned + aSize) {
+      munmap(reinterpret_cast<void*>(aligned + aSize), begin + padded - (aligned + aSize));
+    }
+    return reinterpret_cast<void*>(aligned);
+    #else
+    void* mem = nullptr;
+    if (posix_memalign(&mem, aAlign, aSize) != 0) {
+      return nullptr;
+    }
+    return mem;
+    #endif
+  }
+
+  static void unmapMemory(void* aMem, size_t aSize) {
+    #if defined(VAL_COMPRESSED)
+    cageRelease(aMem, aSize);
+    #elif defined(AOTJS_MMAP)
+    munmap(aMem, aSize);
+    #else
+    std::free(aMem);
+    #endif
+  }
+
+  Chunk* Heap::newChunk() {
+    void* mem = mapMemory(Chunk::size, Chunk::size);
+    if (!mem) {
+      #ifdef DEBUG
+      std::cerr << "out of memory allocating chunk\n";
+      #endif
+      std::abort();
+    }
+    #if defined(AOTJS_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    madvise(mem, Chunk::size, MADV_HUGEPAGE);
+    #endif
+    Chunk* chunk = static_cast<Chunk*>(mem);
+    chunk->mNext = mChunks;
+    chunk->mFreeArenas = Chunk::arenaCount - 1;
+    chunk->mDecommitted = false;
+    std::memset(chunk->mFreeBits, 0xff, sizeof(chunk->mFreeBits));
+    chunk->mFreeBits[0] &= ~uint64_t(1);
+    mChunks = chunk;
+    return chunk;
+  }
+
+  void Heap::releaseChunk(Chunk* aChunk) {
+    unmapMemory(aChunk, Chunk::size);
+  }
+
+  Arena* Heap::newArena(size_t aCellSize, size_t aReservedSize) {
+    void* mem = nullptr;
+    if (aReservedSize == Arena::size) {
+      Chunk* chunk = mChunks;
+      while (chunk && chunk->mFreeArenas == 0) {
+        chunk = chunk->mNext;
+      }
+      if (!chunk) {
+        chunk = newChunk();
+      }
+      for (size_t word = 0; !mem; word++) {
+        if (chunk->mFreeBits[word]) {
+          size_t bit = __builtin_ctzll(chunk->mFreeBits[word]);
+          chunk->mFreeBits[word] &= ~(uint64_t(1) << bit);
+          mem = chunk->arenaAt(word * 64 + bit);
+        }
+      }
+      chunk->mFreeArenas--;
+      chunk->mDecommitted = false;
+    } else {
+      mem = mapMemory(aReservedSize, Arena::size);
+      if (!mem) {
+        #ifdef DEBUG
+        std::cerr << "out of memory allocating arena\n";
+        #endif
+        std::abort();
+      }
+    }
+    Arena* arena = static_cast<Arena*>(mem);
+    arena->mNext = nullptr;
+    arena->mNextAvailable = nullptr;
+    arena->mFreeList = nullptr;
+    arena->mFreeCount = 0;
+    arena->mCellSize = aCellSize;
+    arena->mReservedSize = aReservedSize;
+    arena->mAvailable = false;
+    arena->mSweepPending = false;
+    arena->mEvacuated = false;
+    arena->mNextSweep = nullptr;
+    std::memset(arena->mAllocBits, 0, sizeof(arena->mAllocBits));
+    std::memset(arena->mDeadBits, 0, sizeof(arena->mDeadBits));
+    std::memset(arena->mPinnedBits, 0, sizeof(arena->mPinnedBits));
+    arena->clearMarks();
+    return arena;
+  }
+
+  void Heap::releaseArena(Arena* aArena) {
+    if (aArena->mReservedSize != Arena::size) {
+      // Large arenas get their own mapping. This may be on the finalizer
+      // thread, so mustn't touch anything else.
+      unmapMemory(aArena, aArena->mReservedSize);
+      return;
+    }
+    Chunk* chunk = Chunk::fromArena(aArena);
+    size_t index = chunk->indexOf(aArena);
+    chunk->mFreeBits[index / 64] |= uint64_t(1) << (index % 64);
+    chunk->mFreeArenas++;
+  }
+
+  void Heap::releaseEmptyArenas() {
+    for (auto& sizeClass : mSizeClasses) {
+      bool released = false;
+      Arena** link = &sizeClass.mArenas;
+      while (Arena* arena = *link) {
+        if (arena->isEmpty() && !arena->mSweepPending) {
+          *link = arena->mNext;
+          releaseArena(arena);
+          released = true;
+        } else {
+          link = &arena->mNext;
+        }
+      }
+      if (released) {
+        rebuildAvailable(sizeClass);
+      }
+    }
+  }
+
+  void Heap::decommitEmptyChunks() {
+    size_t retained = 0;
+    Chunk** link = &mChunks;
+    while (Chunk* chunk = *link) {
+      if (!chunk->isEmpty() || chunk->mDecommitted) {
+        link = &chunk->mNext;
+        continue;
+      }
+      if (retained + Chunk::size <= mRetainedBytes) {
+        retained += Chunk::size;
+        link = &chunk->mNext;
+        continue;
+      }
+      #ifdef AOTJS_MMAP
+      // Keep the header and the address range; the rest reads back as
+      // zeroes whenever it's next used.
+      madvise(chunk->arenaAt(1), Chunk::size - Arena::size, MADV_DONTNEED);
+      chunk->mDecommitted = true;
+      link = &chunk->mNext;
+      #else
+      *link = chunk->mNext;
+      releaseChunk(chunk);
+      #endif
+    }
+  }
+
+  void Heap::makeAvailable(SizeClass& aClass, Arena* aArena) {
+    if (!aArena->mAvailable) {
+      aArena->mAvailable = true;
+      aArena->mNextAvailable = aClass.mAvailable;
+      aClass.mAvailable = aArena;
+    }
+  }
+
+  void Heap::rebuildAvailable(SizeClass& aClass) {
+    aClass.mAvailable = nullptr;
+    for (Arena* arena = aClass.mArenas; arena; arena = arena->mNext) {
+      arena->mAvailable = false;
+      if (!arena->mEvacuated && arena->mFreeList) {
+        makeAvailable(aClass, arena);
+      }
+    }
+  }
+
+  void* Heap::allocateSlow(SizeClass& aClass) {
+    // Before growing the heap, see if any dead cells can be reused.
+    #ifdef AOTJS_THREADS
+    reclaimFinalized();
+    if (aClass.mAvailable) {
+      return allocate(aClass.mCellSize);
+    }
+    #endif
+    while (Arena* pending = aClass.mSweepQueue) {
+      aClass.mSweepQueue = pending->mNextSweep;
+      finalizeDead(pending);
+      reclaimDead(pending);
+      if (aClass.mAvailable) {
+        return allocate(aClass.mCellSize);
+      }
+    }
+
+    Arena* arena = newArena(aClass.mCellSize, Arena::size);
+    arena->mNext = aClass.mArenas;
+    aClass.mArenas = arena;
+
+    // Thread the free list in reverse so cells are handed out in
+    // address order.
+    uint8_t* begin = arena->cellsBegin();
+    uint8_t* end = arena->cellsEnd();
+    size_t count = (end - begin) / aClass.mCellSize;
+    for (size_t i = count; i > 0; i--) {
+      arena->pushFree(begin + (i - 1) * aClass.mCellSize);
+    }
+    makeAvailable(aClass, arena);
+    return allocate(aClass.mCellSize);
+  }
+
+  void* Heap::allocateLarge(size_t aSize) {
+    sweepLargeQueue();
+    size_t reserved = (Arena::headerSize() + aSize + Arena::size - 1) & ~(Arena::size - 1);
+    Arena* arena = newArena(aSize, reserved);
+    arena->mNext = mLargeArenas;
+    mLargeArenas = arena;
+    return arena->cellsBegin();
+  }
+
+  void Heap::free(void* aPtr) {
+    Arena* arena = Arena::fromPointer(aPtr);
+    arena->clearAllocated(aPtr);
+    arena->clearPinned(aPtr);
+    if (arena->mCellSize > maxSmallSize) {
+      for (Arena** link = &mLargeArenas; *link; link = &(*link)->mNext) {
+        if (*link == arena) {
+          *link = arena->mNext;
+          releaseArena(arena);
+          return;
+        }
+      }
+      return;
+    }
+    arena->pushFree(aPtr);
+    makeAvailable(mSizeClasses[sizeClassIndex(arena->mCellSize)], arena);
+  }
+
+  // Walk the allocation bitmap a word at a time, calling aFunc on the
+  // object starting at each set bit.
+  template <typename F>
+  static void forEachInArena(Arena* aArena, F aFunc) {
+    for (size_t word = 0; word < Arena::bitmapWords; word++) {
+      uint64_t bits = aArena->mAllocBits[word];
+      while (bits) {
+        size_t bit = __builtin_ctzll(bits);
+        bits &= bits - 1;
+        aFunc(aArena->cellAt(word * 64 + bit));
+      }
+    }
+  }
+
+  template <typename F>
+  void Heap::forEach(F aFunc) {
+    for (auto& sizeClass : mSizeClasses) {
+      for (Arena* arena = sizeClass.mArenas; arena; arena = arena->mNext) {
+        forEachInArena(arena, aFunc);
+      }
+    }
+    for (Arena* arena = mLargeArenas; arena; arena = arena->mNext) {
+      forEachInArena(arena, aFunc);
+    }
+  }
+
+  size_t Heap::sweep() {
+    // Dead cells from the last GC must be fully dealt with before we add to
+    // them, and lazy sweeping and the finalizer thread have had the whole
+    // time since then. Arenas that leaves empty go back to their chunks.
+    finishSweeping();
+    #ifdef AOTJS_THREADS
+    Arena* background = nullptr;
+    #endif
+    size_t live = 0;
+
+    for (auto& sizeClass : mSizeClasses) {
+      for (Arena* arena = sizeClass.mArenas; arena; arena = arena->mNext) {
+        bool died = false;
+        size_t survivors = 0;
+        for (size_t word = 0; word < Arena::bitmapWords; word++) {
+          // Allocated but unmarked: no findable references.
+          // Cells still under construction aren't allocated yet, so stay.
+          uint64_t dead = arena->mAllocBits[word] & ~arena->mMarkBits[word];
+          survivors += __builtin_popcountll(arena->mAllocBits[word] & ~dead);
+          if (!dead) {
+            continue;
+          }
+          #ifdef DEBUG
+          for (uint64_t bits = dead; bits; bits &= bits - 1) {
+            GCThing* obj = arena->cellAt(word * 64 + __builtin_ctzll(bits));
+            std::cerr << "removing dead object: " << obj->dump() << "\n";
+          }
+          #endif
+          arena->mAllocBits[word] &= ~dead;
+          arena->mPinnedBits[word] &= ~dead;
+          arena->mDeadBits[word] |= dead;
+          died = true;
+        }
+        // Reset the marks for next time.
+        arena->clearMarks();
+        live += survivors * sizeClass.mCellSize;
+        if (died && !arena->mSweepPending) {
+          arena->mSweepPending = true;
+          #ifdef AOTJS_THREADS
+          if (mBackgroundFinalization) {
+            arena->mNextSweep = background;
+            background = arena;
+            continue;
+          }
+          #endif
+          arena->mNextSweep = sizeClass.mSweepQueue;
+          sizeClass.mSweepQueue = arena;
+        }
+      }
+    }
+
+    // Large objects die with their arena.
+    Arena** link = &mLargeArenas;
+    while (Arena* arena = *link) {
+      GCThing* obj = reinterpret_cast<GCThing*>(arena->cellsBegin());
+      if (!arena->isAllocated(obj) || arena->isMarked(obj)) {
+        // Live, or still under construction.
+        arena->clearMarks();
+        live += arena->mCellSize;
+        link = &arena->mNext;
+        continue;
+      }
+      #ifdef DEBUG
+      std::cerr << "removing dead object: " << obj->dump() << "\n";
+      #endif
+      *link = arena->mNext;
+      #ifdef AOTJS_THREADS
+      if (mBackgroundFinalization) {
+        arena->mNextSweep = background;
+        background = arena;
+        continue;
+      }
+      #endif
+      arena->mNextSweep = mLargeSweepQueue;
+      mLargeSweepQueue = arena;
+    }
+
+    #ifdef AOTJS_THREADS
+    if (background) {
+      std::lock_guard<std::mutex> lock(mFinalizerLock);
+      mFinalizeQueue = background;
+      mFinalizerWake.notify_one();
+    }
+    #endif
+    return live;
+  }
+
+  void Heap::finalizeDead(Arena* aArena) {
+    if (aArena->mCellSize > maxSmallSize) {
+      GCThing* obj = reinterpret_cast<GCThing*>(aArena->cellsBegin());
+      obj->finalizeForGC();
+      return;
+    }
+    for (size_t word = 0; word < Arena::bitmapWords; word++) {
+      for (uint64_t dead = aArena->mDeadBits[word]; dead; dead &= dead - 1) {
+        aArena->cellAt(word * 64 + __builtin_ctzll(dead))->finalizeForGC();
+      }
+    }
+  }
+
+  void Heap::reclaimDead(Arena* aArena) {
+    for (size_t word = 0; word < Arena::bitmapWords; word++) {
+      uint64_t dead = aArena->mDeadBits[word];
+      aArena->mDeadBits[word] = 0;
+      while (dead) {
+        size_t bit = __builtin_ctzll(dead);
+        dead &= dead - 1;
+        aArena->pushFree(aArena->cellAt(word * 64 + bit));
+      }
+    }
+    aArena->mSweepPending = false;
+    if (aArena->mFreeList) {
+      makeAvailable(mSizeClasses[sizeClassIndex(aArena->mCellSize)], aArena);
+    }
+  }
+
+  void Heap::sweepLargeQueue() {
+    while (Arena* arena = mLargeSweepQueue) {
+      mLargeSweepQueue = arena->mNextSweep;
+      finalizeDead(arena);
+      releaseArena(arena);
+    }
+  }
+
+  void Heap::finishSweeping() {
+    #ifdef AOTJS_THREADS
+    waitForFinalizer();
+    reclaimFinalized();
+    #endif
+    for (auto& sizeClass : mSizeClasses) {
+      while (Arena* arena = sizeClass.mSweepQueue) {
+        sizeClass.mSweepQueue = arena->mNextSweep;
+        finalizeDead(arena);
+        reclaimDead(arena);
+      }
+    }
+    sweepLargeQueue();
+    releaseEmptyArenas();
+    decommitEmptyChunks();
+  }
+
+  size_t Heap::evacuateSparseArenas() {
+    size_t moved = 0;
+    for (auto& sizeClass : mSizeClasses) {
+      // Count up how full each arena is.
+      struct Usage {
+        Arena* mArena;
+        size_t mLive;
+        size_t mFree;
+      };
+      vector<Usage> usage;
+      size_t freeCells = 0;
+      for (Arena* arena = sizeClass.mArenas; arena; arena = arena->mNext) {
+        size_t live = 0;
+        for (auto word : arena->mAllocBits) {
+          live += __builtin_popcountll(word);
+        }
+        usage.push_back(Usage { arena, live, arena->mFreeCount });
+        freeCells += arena->mFreeCount;
+      }
+
+      // Empty the sparsest arenas first, while the rest have room.
+      std::sort(usage.begin(), usage.end(), [] (const Usage& a, const Usage& b) {
+        return a.mLive < b.mLive;
+      });
+      size_t moving = 0;
+      for (auto& entry : usage) {
+        Arena* arena = entry.mArena;
+        if (entry.mLive + entry.mFree < arena->cellCount() || arena->hasPinned()) {
+          // A cell in use by an object still being constructed, or by one
+          // that mustn't move.
+          continue;
+        }
+        if (freeCells - entry.mFree < moving + entry.mLive) {
+          break;
+        }
+        arena->mEvacuated = true;
+        freeCells -= entry.mFree;
+        moving += entry.mLive;
+      }
+      if (moving == 0) {
+        continue;
+      }
+
+      // Only allocate from the arenas we're keeping.
+      rebuildAvailable(sizeClass);
+
+      for (Arena* arena = sizeClass.mArenas; arena; arena = arena->mNext) {
+        if (!arena->mEvacuated) {
+          continue;
+        }
+        forEachInArena(arena, [&] (GCThing* obj) {
+          GCThing* copy = obj->relocateForGC(allocate(sizeClass.mCellSize));
+          registerThing(*copy);
+          obj->finalizeForGC();
+          *reinterpret_cast<GCThing**>(obj) = copy;
+          moved++;
+        });
+        std::memset(arena->mAllocBits, 0, sizeof(arena->mAllocBits));
+      }
+    }
+    return moved;
+  }
+
+  void Heap::releaseEvacuated() {
+    for (auto& sizeClass : mSizeClasses) {
+      Arena** link = &sizeClass.mArenas;
+      while (Arena* arena = *link) {
+        if (arena->mEvacuated) {
+          *link = arena->mNext;
+          releaseArena(arena);
+        } else {
+          link = &arena->mNext;
+        }
+      }
+    }
+    decommitEmptyChunks();
+  }
+
+  #ifdef AOTJS_THREADS
+
+  void Heap::setBackgroundFinalization(bool aEnabled) {
+    if (aEnabled == mBackgroundFinalization) {
+      return;
+    }
+    if (aEnabled) {
+      mFinalizerStop = false;
+      mFinalizer = std::thread([this] { finalizerLoop(); });
+    } else {
+      {
+        std::lock_guard<std::mutex> lock(mFinalizerLock);
+        mFinalizerStop = true;
+        mFinalizerWake.notify_one();
+      }
+      mFinalizer.join();
+      reclaimFinalized();
+    }
+    mBackgroundFinalization = aEnabled;
+  }
+
+  void Heap::finalizerLoop() {
+    std::unique_lock<std::mutex> lock(mFinalizerLock);
+    for (;;) {
+      mFinalizerWake.wait(lock, [this] {
+        return mFinalizeQueue || mFinalizerStop;
+      });
+      Arena* arena = mFinalizeQueue;
+      if (!arena) {
+        return;
+      }
+      mFinalizeQueue = nullptr;
+      mFinalizerBusy = true;
+      lock.unlock();
+
+      Arena* finished = nullptr;
+      while (arena) {
+        Arena* next = arena->mNextSweep;
+        finalizeDead(arena);
+        if (arena->mCellSize > maxSmallSize) {
+          releaseArena(arena);
+        } else {
+          arena->mNextSweep = finished;
+          finished = arena;
+        }
+        arena = next;
+      }
+
+      lock.lock();
+      while (finished) {
+        Arena* next = finished->mNextSweep;
+        finished->mNextSweep = mFinalized;
+        mFinalized = finished;
+        finished = next;
+      }
+      mFinalizerBusy = false;
+      mFinalizerIdle.notify_all();
+    }
+  }
+
+  void Heap::waitForFinalizer() {
+    std::unique_lock<std::mutex> lock(mFinalizerLock);
+    mFinalizerIdle.wait(lock, [this] {
+      return !mFinalizeQueue && !mFinalizerBusy;
+    });
+  }
+
+  void Heap::reclaimFinalized() {
+    Arena* arena;
+    {
+      std::lock_guard<std::mutex> lock(mFinalizerLock);
+      arena = mFinalized;
+      mFinalized = nullptr;
+    }
+    while (arena) {
+      Arena* next = arena->mNextSweep;
+      reclaimDead(arena);
+      arena = next;
+    }
+  }
+
+  #else
+
+  void Heap::setBackgroundFinalization(bool aEnabled) {
+    // No threads to do it on; lazy sweeping it is.
+  }
+
+  #endif
+
+  #pragma mark Nursery
+
+  Nursery::Nursery()
+  : mBegin(nullptr),
+    mTop(nullptr),
+    mLimit(nullptr),
+    mEnd(nullptr),
+    mPending(0)
+  {
+    // Empty until init(), so everything allocated before then is tenured.
+  }
+
+  Nursery::~Nursery() {
+    forEach([] (GCThing* obj) {
+      obj->finalizeForGC();
+    });
+    if (mBegin) {
+      unmapMemory(mBegin, mEnd - mBegin);
+    }
+  }
+
+  void Nursery::init(size_t aSize) {
+    mBegin = static_cast<uint8_t*>(mapMemory(aSize, Arena::size));
+    if (!mBegin) {
+      #ifdef DEBUG
+      std::cerr << "out of memory allocating nursery\n";
+      #endif
+      std::abort();
+    }
+    mTop = mBegin;
+    mEnd = mBegin + aSize;
+    mLimit = mEnd;
+  }
+
+  ///
+  /// Promotes any nursery object it finds to the tenured heap, updating
+  /// the slot to point at the new copy.
+  ///
+  class EvacuateTracer : public GCTracer {
+    Engine& mEngine;
+
+  public:
+    // Whether to shade what's promoted gray, while marking.
+    bool mShade;
+
+    EvacuateTracer(Engine& aEngine, bool aShade)
+    : mEngine(aEngine),
+      mShade(aShade)
+    {
+      //
+    }
+
+    GCThing* promote(GCThing* aThing) {
+      GCThing* moved = mEngine.evacuate(aThing);
+      if (mShade) {
+        mEngine.markGray(moved);
+      }
+      return moved;
+    }
+
+    void trace(Val& aSlot) override {
+      if (aSlot.isGCThing()) {
+        GCThing* thing = &aSlot.asGCThing();
+        if (mEngine.isYoung(thing)) {
+          aSlot = Val(promote(thing));
+        }
+      }
+    }
+
+    void trace(GCThing*& aSlot) override {
+      if (aSlot && mEngine.isYoung(aSlot)) {
+        aSlot = promote(aSlot);
+      }
+    }
+  };
+
+  ///
+  /// Shades each tenured object it finds gray, for tracing later.
+  /// Nursery objects are left for the next minor GC to deal with.
+  ///
+  class MarkTracer : public GCTracer {
+    Engine& mEngine;
+
+  public:
+    MarkTracer(Engine& aEngine)
+    : mEngine(aEngine)
+    {
+      //
+    }
+
+    void trace(Val& aSlot) override {
+      if (aSlot.isGCThing()) {
+        mEngine.markGray(&aSlot.asGCThing());
+      }
+    }
+
+    void trace(GCThing*& aSlot) override {
+      if (aSlot) {
+        mEngine.markGray(aSlot);
+      }
+    }
+  };
+
+  #ifdef AOTJS_THREADS
+
+  ///
+  /// Marks with several threads, each working off its own stack of gray
+  /// objects. A thread with plenty of work moves a batch of it to its
+  /// shared stack, which the others steal from once they run dry.
+  ///
+  /// Mark bits are set atomically, so only the thread which set an
+  /// object's bit traces it. Collection is over once every thread is idle
+  /// with nothing left to steal.
+  ///
+  class ParallelMarker {
+    static const size_t shareBatch = 64;
+
+    struct Worker {
+      vector<GCThing*> mLocal;
+      vector<GCThing*> mShared;
+      std::atomic<size_t> mSharedSize;
+      std::mutex mLock;
+
+      Worker() : mSharedSize(0) {}
+    };
+
+    class Tracer : public GCTracer {
+      ParallelMarker& mMarker;
+      Worker& mWorker;
+
+    public:
+      Tracer(ParallelMarker& aMarker, Worker& aWorker)
+      : mMarker(aMarker),
+        mWorker(aWorker)
+      {
+        //
+      }
+
+      void trace(Val& aSlot) override {
+        if (aSlot.isGCThing()) {
+          mMarker.markGray(mWorker, &aSlot.asGCThing());
+        }
+      }
+
+      void trace(GCThing*& aSlot) override {
+        if (aSlot) {
+          mMarker.markGray(mWorker, aSlot);
+        }
+      }
+    };
+
+    Engine& mEngine;
+    vector<std::unique_ptr<Worker>> mWorkers;
+    size_t mLocalLimit;
+    std::atomic<size_t> mIdle;
+    std::atomic<bool> mOverflowed;
+
+    void markGray(Worker& aWorker, GCThing* aObj) {
+      if (mEngine.isYoung(aObj) || !Arena::fromPointer(aObj)->setMarkedAtomic(aObj)) {
+        return;
+      }
+      if (aWorker.mLocal.size() < mLocalLimit) {
+        aWorker.mLocal.push_back(aObj);
+      } else {
+        // Left marked but untraced, for the heap rescan to find.
+        mOverflowed = true;
+      }
+    }
+
+    void share(Worker& aWorker) {
+      if (aWorker.mLocal.size() < 2 * shareBatch || aWorker.mSharedSize > 0) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(aWorker.mLock);
+      auto batch = aWorker.mLocal.end() - shareBatch;
+      aWorker.mShared.insert(aWorker.mShared.end(), batch, aWorker.mLocal.end());
+      aWorker.mLocal.erase(batch, aWorker.mLocal.end());
+      aWorker.mSharedSize = aWorker.mShared.size();
+    }
+
+    bool steal(Worker& aWorker) {
+      for (auto& victim : mWorkers) {
+        if (victim->mSharedSize == 0) {
+          continue;
+        }
+        std::lock_guard<std::mutex> lock(victim->mLock);
+        vector<GCThing*>& shared = victim->mShared;
+        if (shared.empty()) {
+          continue;
+        }
+        // Take half, leaving the rest for other thieves.
+        auto taken = shared.begin() + shared.size() / 2;
+        aWorker.mLocal.insert(aWorker.mLocal.end(), taken, shared.end());
+        shared.erase(taken, shared.end());
+        victim->mSharedSize = shared.size();
+        return true;
+      }
+      return false;
+    }
+
+    bool anyShared() const {
+      for (auto& worker : mWorkers) {
+        if (worker->mSharedSize > 0) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void run(Worker& aWorker) {
+      Tracer tracer(*this, aWorker);
+      for (;;) {
+        while (!aWorker.mLocal.empty()) {
+          GCThing* obj = aWorker.mLocal.back();
+          aWorker.mLocal.pop_back();
+          if (!aWorker.mLocal.empty()) {
+            AOTJS_PREFETCH(aWorker.mLocal.back());
+          }
+          obj->traceRefsForGC(tracer);
+          share(aWorker);
+        }
+        if (steal(aWorker)) {
+          continue;
+        }
+
+        // Only threads with work can make more, so once we're all idle
+        // we're done.
+        mIdle++;
+        for (;;) {
+          if (mIdle == mWorkers.size()) {
+            return;
+          }
+          if (anyShared()) {
+            mIdle--;
+            if (steal(aWorker)) {
+              break;
+            }
+            mIdle++;
+          }
+          std::this_thread::yield();
+        }
+      }
+    }
+
+  public:
+    ParallelMarker(Engine& aEngine, size_t aThreads, size_t aStackLimit)
+    : mEngine(aEngine),
+      mWorkers(),
+      mLocalLimit(aStackLimit / aThreads),
+      mIdle(0),
+      mOverflowed(false)
+    {
+      for (size_t i = 0; i < aThreads; i++) {
+        mWorkers.emplace_back(new Worker());
+      }
+    }
+
+    ///
+    /// Deal out the gray objects, then mark everything reachable from them.
+    /// Returns false if a thread's stack overflowed, leaving some marked
+    /// objects untraced.
+    ///
+    bool mark(vector<GCThing*>& aGray) {
+      for (size_t i = 0; i < aGray.size(); i++) {
+        mWorkers[i % mWorkers.size()]->mLocal.push_back(aGray[i]);
+      }
+      aGray.clear();
+
+      vector<std::thread> threads;
+      for (size_t i = 1; i < mWorkers.size(); i++) {
+        Worker& worker = *mWorkers[i];
+        threads.emplace_back([this, &worker] { run(worker); });
+      }
+      run(*mWorkers[0]);
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      return !mOverflowed;
+    }
+  };
+
+  #endif
 
-  template <>
-  TypeOf Box<Deleted>::typeOf() const {
-    return typeOfDeleted;
-  }
+  ///
+  /// Points any slot referring to an object moved by compaction at its
+  /// new address.
+  ///
+  class CompactTracer : public GCTracer {
+    Engine& mEngine;
 
-  template<class T>
-  string Box<T>::dump() {
-    std::ostringstream buf;
-    buf << val();
-    return buf.str();
-  };
+  public:
+    CompactTracer(Engine& aEngine)
+    : mEngine(aEngine)
+    {
+      //
+    }
 
-  template<>
-  string Box<Undefined>::dump() {
-    return val();
-  };
+    void trace(Val& aSlot) override {
+      if (aSlot.isGCThing()) {
+        GCThing* thing = &aSlot.asGCThing();
+        if (!mEngine.isYoung(thing) && Heap::isForwarded(thing)) {
+          aSlot = Val(Heap::forwardedAddress(thing));
+        }
+      }
+    }
 
-  template<>
-  string Box<Null>::dump() {
-    return val();
+    void trace(GCThing*& aSlot) override {
+      if (aSlot && !mEngine.isYoung(aSlot) && Heap::isForwarded(aSlot)) {
+        aSlot = Heap::forwardedAddress(aSlot);
+      }
+    }
   };
 
-  template<>
-  string Box<Deleted>::dump() {
-    return val();
-  };
+  #pragma mark Engine
 
-  #pragma mark Object
+  // warning: if stack goes beyond this it will explode
+  Engine::Engine(size_t aStackSize)
+  : mReadyForGC(false),
+    mAllocatedBytes(0),
+    mLiveBytes(0),
+    mMinHeapSize(defaultMinHeapSize),
+    mGrowthFactor(defaultGrowthFactor),
+    mMaxHeapSize(0),
+    mHeap(),
+    mNursery(),
+    mRememberedSet(),
+    mRememberedCells(),
+    mPromoted(),
+    mIncremental(false),
+    mMarking(false),
+    mSliceBudget(defaultSliceBudget),
+    mTenuredSinceSlice(0),
+    mMarkStack(),
+    mMarkStackLimit(defaultMarkStackLimit),
+    mMarkStackOverflowed(false),
+    mMarkThreads(1),
+    mRoot(new Object()),
+    mStackBegin(newStack(aStackSize)),
+    mStackTop(mStackBegin),
+    mStackEnd(mStackBegin + aStackSize)
+  {
+    // Ok, now that we've initialized those things it's safe
+    // to enable the GC registration system.
+    mReadyForGC = true;
+    registerForGC(*mRoot);
 
-  Object::~Object() {
-    //
+    // Only now can new objects start out young.
+    mNursery.init(Nursery::defaultSize);
   }
 
-  TypeOf Object::typeOf() const {
-    return typeOfObject;
+  Engine::~Engine() {
+    #ifdef AOTJS_MMAP
+    munmap(mStackBegin, (mStackEnd - mStackBegin) * sizeof(Val));
+    #else
+    delete[] mStackBegin;
+    #endif
   }
 
-  static Local normalizePropName(Local aName) {
-    ScopeRetVal scope;
-    if (aName->isString()) {
-      return scope.escape(aName);
-    } else if (aName->isSymbol()) {
-      return scope.escape(aName);
-    } else {
-      // todo: convert to string
+  Val* Engine::newStack(size_t aStackSize) {
+    #ifdef AOTJS_MMAP
+    // Reserve the whole thing up front; pages only become resident as deep
+    // as the stack actually gets. Slots are always written before use.
+    void* mem = mmap(nullptr, aStackSize * sizeof(Val), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
       #ifdef DEBUG
-      std::cerr << "cannot use non-string/symbol as property index";
+      std::cerr << "out of memory allocating stack\n";
       #endif
       std::abort();
-      return scope.escape(Undefined());
     }
+    return static_cast<Val*>(mem);
+    #else
+    return new Val[aStackSize];
+    #endif
   }
 
-  // todo: handle numeric indices
-  // todo: getters
-  Local Object::getProp(Local aName) {
-    ScopeRetVal scope;
-    Local name = normalizePropName(aName);
-    auto index = mProps.find(*name);
-    if (index == mProps.end()) {
-      if (mPrototype) {
-        return scope.escape(mPrototype->getProp(name));
-      } else {
-        return scope.escape(Undefined());
+  void* Engine::allocateForGCSlow(size_t aSize) {
+    if (mMarking && mNursery.mLimit < mNursery.mEnd) {
+      // Hit the slice limit rather than the end of the nursery.
+      markSlice(mSliceBudget);
+      resetNurseryLimit();
+      void* ptr = mNursery.allocate(aSize);
+      if (ptr) {
+        return ptr;
+      }
+    }
+
+    // The nursery is full, or not ready yet, or this object is too big.
+    // Can't reuse the nursery while a cell in it is waiting on constructor
+    // arguments, so fall back to the tenured heap until that's done.
+    if (mReadyForGC && aSize <= Nursery::maxObjectSize && mNursery.mPending == 0) {
+      minorGC();
+      maybeGC();
+      checkHeapLimit(0);
+      void* ptr = mNursery.allocate(aSize);
+      if (ptr) {
+        return ptr;
       }
-    } else {
-      return scope.escape(index->first);
     }
+    return allocateTenuredForGC(aSize);
   }
 
-  void Object::setProp(Local aName, Local aVal) {
-    Local name = *normalizePropName(aName);
-    mProps.emplace(*name, *aVal);
+  void* Engine::allocateTenuredForGC(size_t aSize) {
+    if (mMarking) {
+      mTenuredSinceSlice += aSize;
+      if (mTenuredSinceSlice >= sliceBytes) {
+        mTenuredSinceSlice = 0;
+        markSlice(mSliceBudget);
+      }
+    }
+    maybeGC();
+    checkHeapLimit(aSize);
+    mAllocatedBytes += aSize;
+    return mHeap.allocate(aSize);
   }
 
-  void Object::markRefsForGC() {
-    for (auto iter : mProps) {
-      auto prop_name(iter.first);
-      auto prop_val(iter.second);
+  void* Engine::allocatePinnedForGC(size_t aSize) {
+    void* ptr = allocateTenuredForGC(aSize);
+    Arena::fromPointer(ptr)->setPinned(ptr);
+    return ptr;
+  }
 
-      prop_name.markForGC();
-      prop_val.markForGC();
+  void Engine::pinForGC(GCThing& aObj) {
+    if (!isYoung(&aObj)) {
+      Arena::fromPointer(&aObj)->setPinned(&aObj);
     }
   }
 
-  string Object::dump() {
-    std::ostringstream buf;
-    buf << "Object({";
-
-    bool first = true;
-    for (auto iter : mProps) {
-      auto name = iter.first;
-      auto val = iter.second;
+  void Engine::freeForGC(void* aPtr) {
+    if (mNursery.contains(aPtr)) {
+      Nursery::headerOf(aPtr)->mState = Nursery::Dead;
+      mNursery.mPending--;
+    } else {
+      mHeap.free(aPtr);
+    }
+  }
 
-      if (first) {
-        first = false;
-      } else {
-        buf << ",";
+  void Engine::registerForGC(GCThing& obj) {
+    if (isYoung(&obj)) {
+      mNursery.registerThing(obj);
+    } else if (mReadyForGC) {
+      mHeap.registerThing(obj);
+      if (mMarking) {
+        // Allocated gray: its refs get traced once it's constructed.
+        pushGray(&obj);
       }
-      buf << name.dump();
-      buf << ":";
-      buf << val.dump();
     }
-    buf << "})";
-    return buf.str();
   }
 
-  #pragma mark PropIndex
-  PropIndex::~PropIndex() {
-    //
+  void Engine::rememberForGC(GCThing& aObj) {
+    if (!aObj.mRemembered) {
+      aObj.mRemembered = true;
+      mRememberedSet.push_back(&aObj);
+    }
   }
 
-  #pragma mark String
-
-  String::~String() {
-    //
+  void Engine::rememberCellForGC(Cell& aCell) {
+    aCell.mRemembered = true;
+    mRememberedCells.push_back(&aCell);
   }
 
-  TypeOf String::typeOf() const {
-    return typeOfString;
-  }
+  GCThing* Engine::evacuate(GCThing* aObj) {
+    Nursery::Header* header = Nursery::headerOf(aObj);
+    if (header->mState == Nursery::Forwarded) {
+      return *reinterpret_cast<GCThing**>(aObj);
+    }
 
-  string String::dump() {
-    // todo: emit JSON or something
-    std::ostringstream buf;
-    buf << "\"";
-    buf << data;
-    buf << "\"";
-    return buf.str();
-  }
+    // Promotion doesn't go through allocateTenuredForGC; we're already
+    // in the middle of a GC. It does count toward the next full one.
+    size_t size = header->mSize - sizeof(Nursery::Header);
+    mAllocatedBytes += size;
+    void* dest = mHeap.allocate(size);
+    GCThing* moved = aObj->relocateForGC(dest);
+    mHeap.registerThing(*moved);
 
-  #pragma mark Symbol
+    aObj->finalizeForGC();
+    header->mState = Nursery::Forwarded;
+    *reinterpret_cast<GCThing**>(aObj) = moved;
 
-  Symbol::~Symbol() {
-    //
+    mPromoted.push_back(moved);
+    return moved;
   }
 
-  TypeOf Symbol::typeOf() const {
-    return typeOfSymbol;
+  void Engine::minorGC() {
+    // Mid-mark, anything promoted may turn out to be referenced from
+    // something already traced, so it all starts gray.
+    promoteNursery(mMarking);
   }
 
-  string Symbol::dump() {
-    std::ostringstream buf;
-    buf << "Symbol(\"";
-    buf << name;
-    buf << "\")";
-    return buf.str();
-  }
+  void Engine::promoteNursery(bool aShadeAll) {
+    if (!mReadyForGC) {
+      return;
+    }
 
-  #pragma mark Internal
+    EvacuateTracer tracer(*this, aShadeAll);
 
-  Internal::~Internal() {
-    //
-  }
+    // Roots: the global object and the Local stack.
+    // The root is allocated before the nursery exists.
+    tracer.traceThing(mRoot);
+    for (Val* record = mStackBegin; record < mStackTop; record++) {
+      tracer.trace(*record);
+    }
 
-  TypeOf Internal::typeOf() const {
-    return typeOfInternal;
-  }
+    // Tenured objects which may point into the nursery.
+    // Otherwise, only marked ones shade what they refer to; they won't
+    // be traced again.
+    for (auto obj : mRememberedSet) {
+      obj->mRemembered = false;
+      tracer.mShade = aShadeAll || (mMarking && obj->isMarkedForGC());
+      obj->traceRefsForGC(tracer);
+    }
+    mRememberedSet.clear();
+    for (auto cell : mRememberedCells) {
+      tracer.mShade = aShadeAll || (mMarking && cell->isMarkedForGC());
+      cell->traceRefsForGC(tracer);
+    }
 
-  #pragma mark JSThing
+    // Promoted objects may in turn point into the nursery.
+    tracer.mShade = aShadeAll;
+    while (!mPromoted.empty()) {
+      GCThing* obj = mPromoted.back();
+      mPromoted.pop_back();
+      obj->traceRefsForGC(tracer);
+    }
 
-  JSThing::~JSThing() {
-    //
+    // Whatever didn't get promoted is garbage.
+    mNursery.forEach([] (GCThing* obj) {
+      #ifdef DEBUG
+      std::cerr << "removing dead young object: " << obj->dump() << "\n";
+      #endif
+      obj->finalizeForGC();
+      Nursery::headerOf(obj)->mState = Nursery::Dead;
+    });
+    if (mNursery.mPending == 0) {
+      mNursery.mTop = mNursery.mBegin;
+    }
+    resetNurseryLimit();
   }
 
-  TypeOf JSThing::typeOf() const {
-    return typeOfJSThing;
+  void Engine::resetNurseryLimit() {
+    if (mMarking) {
+      mNursery.setLimit(sliceBytes);
+    } else {
+      mNursery.mLimit = mNursery.mEnd;
+    }
   }
 
-  Retained<String> JSThing::toString() const {
-    ScopeRet<String> scope;
-    return scope.escape(retain<String>("[jsthing JSThing]"));
+  void Engine::markGray(GCThing* aObj) {
+    if (!isYoung(aObj) && !aObj->isMarkedForGC()) {
+      pushGray(aObj);
+    }
   }
 
-  #pragma mark Cell
-
-  Cell::~Cell() {
-    //
+  void Engine::pushGray(GCThing* aObj) {
+    Arena::fromPointer(aObj)->setMarked(aObj);
+    if (mMarkStack.size() < mMarkStackLimit) {
+      mMarkStack.push_back(aObj);
+    } else {
+      // Left marked but untraced; rescanMarked() will get to it.
+      mMarkStackOverflowed = true;
+    }
   }
 
-  void Cell::markRefsForGC() {
-    mVal.markForGC();
-  }
+  void Engine::markRoots() {
+    // Anything reachable from the global root object.
+    markGray(mRoot);
 
-  string Cell::dump() {
-    std::ostringstream buf;
-    buf << "Cell(" << mVal.dump() << ")";
-    return buf.str();
+    // Anything on the stack of currently open scopes
+    #if DEBUG
+    std::cerr << "stack: [";
+    bool first = true;
+    for (Val* record = mStackBegin; record < mStackTop; record++) {
+      if (first) {
+        first = false;
+      } else {
+        std::cerr << ",";
+      }
+      std::cerr << record->dump();
+    }
+    std::cerr << "]\n";
+    #endif
+    MarkTracer tracer(*this);
+    for (Val* record = mStackBegin; record < mStackTop; record++) {
+      tracer.trace(*record);
+    }
   }
 
-  #pragma mark Function
+  ///
+  /// Traces up to aBudget gray objects, returning true once there are none
+  /// left anywhere.
+  ///
+  bool Engine::drainMarkStack(size_t aBudget) {
+    MarkTracer tracer(*this);
+
+    // Objects come off the stack a few ahead of being traced, and are
+    // prefetched on the way, so they're in cache once we get to them.
+    GCThing* window[markPrefetchDistance];
+    size_t head = 0;
+    size_t count = 0;
+    while (aBudget > 0) {
+      while (count < markPrefetchDistance && !mMarkStack.empty()) {
+        GCThing* obj = mMarkStack.back();
+        mMarkStack.pop_back();
+        AOTJS_PREFETCH(obj);
+        window[(head + count) % markPrefetchDistance] = obj;
+        count++;
+      }
+      if (count == 0) {
+        if (!mMarkStackOverflowed) {
+          break;
+        }
+        rescanMarked();
+        continue;
+      }
 
-  Function::~Function() {
-    //
+      GCThing* obj = window[head];
+      head = (head + 1) % markPrefetchDistance;
+      count--;
+      #ifdef DEBUG
+      std::cerr << "marking object live " << obj->dump() << "\n";
+      #endif
+      obj->traceRefsForGC(tracer);
+      aBudget--;
+    }
+
+    // Out of budget; put back anything we took but didn't trace.
+    while (count > 0) {
+      mMarkStack.push_back(window[head]);
+      head = (head + 1) % markPrefetchDistance;
+      count--;
+    }
+    return mMarkStack.empty() && !mMarkStackOverflowed;
+  }
+
+  void Engine::rescanMarked() {
+    // Some marked objects never made it onto the stack. Tracing everything
+    // marked again finds their unmarked refs; anything already traced just
+    // finds nothing new.
+    #ifdef DEBUG
+    std::cerr << "mark stack overflowed, rescanning heap\n";
+    #endif
+    mMarkStackOverflowed = false;
+    MarkTracer tracer(*this);
+    mHeap.forEach([&] (GCThing* obj) {
+      if (obj->isMarkedForGC()) {
+        obj->traceRefsForGC(tracer);
+      }
+    });
   }
 
-  TypeOf Function::typeOf() const {
-    return typeOfFunction;
+  #ifdef AOTJS_THREADS
+
+  void Engine::setParallelMarking(size_t aThreads) {
+    mMarkThreads = aThreads > 0 ? aThreads : 1;
   }
 
-  void Function::markRefsForGC() {
-    for (auto cell : mCaptures) {
-      cell->markForGC();
+  void Engine::markParallel() {
+    ParallelMarker marker(*this, mMarkThreads, mMarkStackLimit);
+    if (!marker.mark(mMarkStack)) {
+      mMarkStackOverflowed = true;
     }
   }
 
+  #else
 
-  Local Function::call(Local aThis, RawArgList aArgs) {
-    ScopeRetVal scope;
-    return scope.escape(*mBody(*this, aThis, ArgList(*this, aArgs)));
+  void Engine::setParallelMarking(size_t aThreads) {
+    // No threads; always mark serially.
   }
 
-  string Function::dump() {
-    std::ostringstream buf;
-    buf << "Function(\"" << name() << "\")";
-    return buf.str();
+  #endif
+
+  void Engine::markSlice(size_t aBudget) {
+    if (drainMarkStack(aBudget)) {
+      finishGC();
+    }
   }
 
-  #pragma mark Engine
+  void Engine::startIncrementalGC() {
+    mMarking = true;
+    mTenuredSinceSlice = 0;
+    markRoots();
+    resetNurseryLimit();
+  }
+
+  void Engine::finishGC() {
+    // Nursery objects may hold the only refs to some tenured ones, so
+    // promote them before the last of the marking. Nothing runs between
+    // here and the sweep, so only what marked objects refer to needs
+    // shading: the roots are rescanned below, and anything else promoted
+    // is traced from whatever marks it. Young garbage held only by dead
+    // tenured objects stays unmarked, and is swept.
+    promoteNursery(false);
+
+    // The roots and Cells were written without barriers since we started.
+    markRoots();
+    MarkTracer tracer(*this);
+    for (auto cell : mRememberedCells) {
+      if (cell->isMarkedForGC()) {
+        cell->traceRefsForGC(tracer);
+      }
+    }
+    #ifdef AOTJS_THREADS
+    if (mMarkThreads > 1 && !drainMarkStack(parallelMarkThreshold)) {
+      // Still going after a good while; share out the rest.
+      markParallel();
+    }
+    #endif
+    drainMarkStack(SIZE_MAX);
 
-  // warning: if stack goes beyond this it will explode
-  Engine::Engine(size_t aStackSize)
-  : mReadyForGC(false),
-    mUndefined(new Box<Undefined>(Undefined())),
-    mNull(new Box<Null>(Null())),
-    mDeleted(new Box<Deleted>(Deleted())),
-    mFalse(new Box<bool>(false)),
-    mTrue(new Box<bool>(true)),
-    mRoot(new Object()),
-    mStackBegin( new Val[aStackSize]),
-    mStackTop(mStackBegin),
-    mStackEnd(mStackBegin + aStackSize),
-    mObjects()
-  {
-    // Ok, now that we've initialized those things it's safe
-    // to enable the GC registration system.
-    mReadyForGC = true;
-    registerForGC(*mUndefined);
-    registerForGC(*mNull);
-    registerForGC(*mDeleted);
-    registerForGC(*mFalse);
-    registerForGC(*mTrue);
-    registerForGC(*mRoot);
+    // Don't keep scanning cells that are about to be swept.
+    size_t liveCells = 0;
+    for (auto cell : mRememberedCells) {
+      if (cell->isMarkedForGC()) {
+        mRememberedCells[liveCells++] = cell;
+      }
+    }
+    mRememberedCells.resize(liveCells);
+    sweepAtoms();
+
+    // Sweep!
+    // Walks the arenas in place; dead cells go straight back on the
+    // free lists without any side allocation.
+    mLiveBytes = mHeap.sweep();
+
+    mMarking = false;
+    mAllocatedBytes = 0;
+    resetNurseryLimit();
   }
 
-  Engine::~Engine() {
-    delete[] mStackBegin;
+  void Engine::setIncrementalGC(bool aIncremental, size_t aSliceBudget) {
+    mIncremental = aIncremental;
+    mSliceBudget = aSliceBudget;
   }
 
-  void Engine::registerForGC(GCThing& obj) {
-    // Because we don't yet control the allocation, we don't know how to walk
-    // the heap looking for all objects. Instead, we need to keep a separate
-    // set of all objects in order to do the final sweep.
-    if (mReadyForGC) {
-      mObjects.insert(&obj);
+  void Engine::gcSlice(size_t aBudget) {
+    if (!mReadyForGC) {
+      return;
+    }
+    if (!mMarking) {
+      startIncrementalGC();
     }
+    markSlice(aBudget);
   }
 
   Val* Engine::stackTop()
@@ -708,7 +3692,7 @@ namespace AotJS {
   Val* Engine::pushLocal(Val val)
   {
     Val* ptr = mStackTop;
-    if (mStackTop++ > mStackEnd) {
+    if (++mStackTop > mStackEnd) {
       #ifdef DEBUG
       std::cerr << "stack overflow!\n";
       #endif
@@ -738,67 +3722,158 @@ namespace AotJS {
     #endif
 
     if (!mReadyForGC) {
-      // don't try to destroy our singleton sigils during initialization
+      // don't try to destroy our root object during initialization
       return;
     }
 
-    // 1) Mark!
+    // Finish off any incremental collection in progress, or do a whole
+    // one without stopping. Emptying the nursery before marking means
+    // dead tenured objects don't keep what they point to alive.
+    if (!mMarking) {
+      minorGC();
+      mMarking = true;
+      markRoots();
+    }
+    finishGC();
+  }
 
-    // Mark our global sigil objects.
-    mUndefined->markForGC();
-    mNull->markForGC();
-    mDeleted->markForGC();
-    mFalse->markForGC();
-    mTrue->markForGC();
+  size_t Engine::gcThreshold() const {
+    size_t grown = static_cast<size_t>(mLiveBytes * mGrowthFactor);
+    return grown > mMinHeapSize ? grown : mMinHeapSize;
+  }
 
-    // Mark anything reachable from the global root object.
-    mRoot->markForGC();
+  void Engine::setGCLimits(size_t aMinHeapSize, double aGrowthFactor, size_t aMaxHeapSize) {
+    mMinHeapSize = aMinHeapSize;
+    mGrowthFactor = aGrowthFactor;
+    mMaxHeapSize = aMaxHeapSize;
+  }
 
-    // Mark anything on the stack of currently open scopes
-    #if DEBUG
-    std::cerr << "stack: [";
-    bool first = true;
-    for (Val* record = mStackBegin; record < mStackTop; record++) {
-      if (first) {
-        first = false;
-      } else {
-        std::cerr << ",";
-      }
-      std::cerr << record->dump();
+  void Engine::checkHeapLimit(size_t aSize) {
+    if (!mMaxHeapSize || heapSize() + aSize <= mMaxHeapSize) {
+      return;
     }
-    std::cerr << "]\n";
-    #endif
+    emergencyGC();
+    if (heapSize() + aSize > mMaxHeapSize) {
+      #ifdef DEBUG
+      std::cerr << "out of memory: heap limit " << mMaxHeapSize << " reached\n";
+      #endif
+      std::abort();
+    }
+  }
+
+  void Engine::emergencyGC() {
+    if (!mReadyForGC) {
+      return;
+    }
+    gc();
+    mHeap.finishSweeping();
+  }
+
+  void Engine::compact() {
+    if (!mReadyForGC) {
+      return;
+    }
+
+    // Leaves everything in the heap live, and the nursery empty.
+    gc();
+    mHeap.finishSweeping();
+    if (mHeap.evacuateSparseArenas() == 0) {
+      return;
+    }
+
+    // Every object that could refer to a moved one, and the roots.
+    // Cells and Functions are pinned, so captures never need updating,
+    // and neither do property keys.
+    CompactTracer tracer(*this);
+    tracer.traceThing(mRoot);
     for (Val* record = mStackBegin; record < mStackTop; record++) {
-      record->markForGC();
+      tracer.trace(*record);
+    }
+    mHeap.forEach([&] (GCThing* obj) {
+      obj->traceRefsForGC(tracer);
+    });
+    mNursery.forEach([&] (GCThing* obj) {
+      obj->traceRefsForGC(tracer);
+    });
+    mHeap.releaseEvacuated();
+  }
+
+  bool Engine::AtomKeyEqual::operator()(const AtomKey& aLhs, const AtomKey& aRhs) const {
+    return aLhs.mLength == aRhs.mLength &&
+      String::equalUnits(aLhs.mChars, aLhs.mTwoByte, aRhs.mChars, aRhs.mTwoByte, aLhs.mLength);
+  }
+
+  String* Engine::lookupAtom(const String& aString) {
+    // Uses the string's cached hash, so repeat lookups don't rehash.
+    auto iter = mAtoms.find(AtomKey {
+      aString.rawChars(), aString.length(), aString.hash(), aString.isTwoByte()
+    });
+    if (iter == mAtoms.end()) {
+      return nullptr;
     }
+    String* atom = iter->second;
+    if (mMarking && !atom->isMarkedForGC()) {
+      // The table doesn't keep atoms alive, so one we hand back mid-mark
+      // may not have been reached yet. Shade it as a barrier would.
+      markGray(atom);
+    }
+    return atom;
+  }
 
-    // 2) Sweep!
-    // We alloc a vector here ebecause we can't change the set while iterating.
-    // Todo: don't require allocating memory to free memory!
-    std::vector<GCThing *> deadObjects;
-    for (auto obj : mObjects) {
-      if (obj->isMarkedForGC()) {
-        // Keep the object, but reset the marker value for next time.
-        obj->clearForGC();
-      } else {
-        #ifdef DEBUG
-        std::cerr << "removing dead object: " << obj->dump() << "\n";
-        #endif
-        deadObjects.push_back(obj);
-      }
+  String* Engine::addAtom(String* aString) {
+    aString->mAtom = true;
+    pinForGC(*aString);
+    mAtoms.emplace(AtomKey {
+      aString->rawChars(), aString->length(), aString->hash(), aString->isTwoByte()
+    }, aString);
+    return aString;
+  }
+
+  String* Engine::findAtom(const String& aString) {
+    if (aString.isAtom()) {
+      return const_cast<String*>(&aString);
+    }
+    return lookupAtom(aString);
+  }
+
+  Retained<String> Engine::atomize(Local aString) {
+    ScopeRet<String> scope;
+    String* atom = findAtom(aString->asString());
+    if (!atom) {
+      String& str = aString->asString();
+      // Tenured strings can be adopted as they are; young ones would
+      // move, and a Slice's characters are in a parent that might.
+      atom = addAtom(isYoung(&str) || str.isSlice() ? str.tenuredCopy() : &str);
     }
+    return scope.escape(atom);
+  }
 
-    for (auto obj : deadObjects) {
-      // No findable references to this object. Destroy it!
-      mObjects.erase(obj);
-      delete obj;
+  Retained<String> Engine::atomize(const string& aChars) {
+    // Decode first; UTF-8 and the stored units can't be compared directly.
+    ScopeRet<String> scope;
+    Local str(String::create(aChars));
+    return scope.escape(atomize(str));
+  }
+
+  void Engine::sweepAtoms() {
+    // Runs once marking is done; whatever's unmarked is about to be swept.
+    for (auto iter = mAtoms.begin(); iter != mAtoms.end();) {
+      if (iter->second->isMarkedForGC()) {
+        ++iter;
+      } else {
+        iter = mAtoms.erase(iter);
+      }
     }
   }
 
   void Engine::maybeGC() {
-    // todo find a good heuristic
-    if (mAllocations++ % 1024 == 0) {
-      gc();
+    // Counts tenured bytes, including promotions out of the nursery.
+    if (!mMarking && heapSize() >= gcThreshold()) {
+      if (mIncremental) {
+        startIncrementalGC();
+      } else {
+        gc();
+      }
     }
   }
 
@@ -807,14 +3882,16 @@ namespace AotJS {
     buf << "Engine([";
 
     bool first = true;
-    for (auto obj : mObjects) {
+    auto dumpObj = [&] (GCThing* obj) {
       if (first) {
         first = false;
       } else {
         buf << ",";
       }
       buf << obj->dump();
-    }
+    };
+    mHeap.forEach(dumpObj);
+    mNursery.forEach(dumpObj);
     buf << "])";
     return buf.str();
   }
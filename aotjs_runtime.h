@@ -7,17 +7,31 @@
 
 #include <cinttypes>
 #include <cmath>
+#include <cstring>
 
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
+
+// Native builds get the GC heap straight from the system with mmap, so it
+// can be given back; wasm memory never shrinks anyway.
+#if !defined(__EMSCRIPTEN__) && (defined(__unix__) || defined(__APPLE__))
+#define AOTJS_MMAP 1
+#endif
+
+// Native builds can finalize dead objects on a background thread.
+#if !defined(__EMSCRIPTEN__) && !defined(AOTJS_NO_THREADS)
+#define AOTJS_THREADS 1
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
 
 namespace AotJS {
   using ::std::string;
   using ::std::vector;
   using ::std::hash;
-  using ::std::unordered_set;
   using ::std::unordered_map;
 
   typedef const char *TypeOf;
@@ -38,6 +52,24 @@ namespace AotJS {
   extern TypeOf typeOfFunction;
   extern TypeOf typeOfObject;
 
+  ///
+  /// Which concrete class a GCThing is, stored inline in every object so
+  /// type checks and the GC's per-object work are a load and a compare
+  /// rather than a virtual call.
+  ///
+  enum class GCKind : uint8_t {
+    GCThing,
+    Internal,
+    Cell,
+    JSThing,
+    BoxDouble,
+    BoxInt32,
+    String,
+    Symbol,
+    Object,
+    Function
+  };
+
   class Val;
 }
 
@@ -56,6 +88,7 @@ namespace AotJS {
   template <class T> class Retained;
 
   class Scope;
+  class Temp;
 
   typedef std::initializer_list<Local> RawArgList;
   class ArgList;
@@ -115,8 +148,479 @@ namespace AotJS {
     }
   };
 
+  template <typename T> GCKind boxKind();
+  template <> inline GCKind boxKind<double>()    { return GCKind::BoxDouble; }
+  template <> inline GCKind boxKind<int32_t>()   { return GCKind::BoxInt32; }
+
   typedef Local (*FunctionBody)(Function& func, Local this_, ArgList args);
 
+  ///
+  /// Link in a free list threaded through unused heap cells.
+  ///
+  struct FreeCell {
+    FreeCell* mNext;
+  };
+
+  ///
+  /// A page-sized, page-aligned block of GC heap holding cells of a single
+  /// size class, with a header at the start.
+  ///
+  /// Each 16-byte granule of the arena has a bit in the allocation bitmap,
+  /// which is set on the first granule of every cell holding a constructed
+  /// GCThing, and a bit in the mark bitmap, set while marking finds the
+  /// object reachable. Keeping both out of the objects means marking never
+  /// writes to them, and the sweeper finds dead cells a word at a time.
+  ///
+  /// Sweeping only moves dead cells' bits from the allocation bitmap to the
+  /// dead bitmap; their destructors run later, when the arena is finalized.
+  ///
+  /// Cells holding objects which must never move have a bit in the pinned
+  /// bitmap, which keeps compaction from emptying their arena.
+  ///
+  /// Objects too big for the largest size class get an arena of their own,
+  /// with a single cell starting at the same offset as a small arena's first
+  /// cell, so fromPointer() works for both.
+  ///
+  class Arena {
+  public:
+    static const size_t size = 4096;
+    static const size_t granuleSize = 16;
+    static const size_t bitmapWords = size / granuleSize / 64;
+
+    Arena* mNext;          // next arena in the same size class
+    Arena* mNextAvailable; // next arena in the size class with free cells
+    FreeCell* mFreeList;
+    size_t mFreeCount;
+    size_t mCellSize;
+    size_t mReservedSize;  // bytes obtained from the system for this arena
+    bool mAvailable;       // whether we're on the size class's available list
+    bool mSweepPending;    // whether we're waiting to be finalized
+    bool mEvacuated;       // whether our cells hold forwarding pointers
+    Arena* mNextSweep;     // next arena waiting to be finalized
+    uint64_t mAllocBits[bitmapWords];
+    uint64_t mMarkBits[bitmapWords];
+    uint64_t mDeadBits[bitmapWords];
+    uint64_t mPinnedBits[bitmapWords];
+
+    static size_t headerSize();
+
+    static Arena* fromPointer(const void* aPtr) {
+      return reinterpret_cast<Arena*>(reinterpret_cast<uintptr_t>(aPtr) & ~(size - 1));
+    }
+
+    static size_t bitIndex(const void* aPtr) {
+      return (reinterpret_cast<uintptr_t>(aPtr) & (size - 1)) / granuleSize;
+    }
+
+    uint8_t* cellsBegin() {
+      return reinterpret_cast<uint8_t*>(this) + headerSize();
+    }
+
+    uint8_t* cellsEnd() {
+      return reinterpret_cast<uint8_t*>(this) + mReservedSize;
+    }
+
+    bool isAllocated(const void* aPtr) const {
+      size_t index = bitIndex(aPtr);
+      return (mAllocBits[index / 64] >> (index % 64)) & 1;
+    }
+
+    void setAllocated(const void* aPtr) {
+      size_t index = bitIndex(aPtr);
+      mAllocBits[index / 64] |= (uint64_t(1) << (index % 64));
+    }
+
+    void clearAllocated(const void* aPtr) {
+      size_t index = bitIndex(aPtr);
+      mAllocBits[index / 64] &= ~(uint64_t(1) << (index % 64));
+    }
+
+    bool isMarked(const void* aPtr) const {
+      size_t index = bitIndex(aPtr);
+      return (mMarkBits[index / 64] >> (index % 64)) & 1;
+    }
+
+    void setMarked(const void* aPtr) {
+      size_t index = bitIndex(aPtr);
+      mMarkBits[index / 64] |= (uint64_t(1) << (index % 64));
+    }
+
+    ///
+    /// For parallel marking: sets the mark bit, returning false if it was
+    /// already set, perhaps by another thread.
+    ///
+    bool setMarkedAtomic(const void* aPtr) {
+      size_t index = bitIndex(aPtr);
+      uint64_t bit = uint64_t(1) << (index % 64);
+      uint64_t* word = &mMarkBits[index / 64];
+      if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+        return false;
+      }
+      return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+    }
+
+    void setPinned(const void* aPtr) {
+      size_t index = bitIndex(aPtr);
+      mPinnedBits[index / 64] |= (uint64_t(1) << (index % 64));
+    }
+
+    void clearPinned(const void* aPtr) {
+      size_t index = bitIndex(aPtr);
+      mPinnedBits[index / 64] &= ~(uint64_t(1) << (index % 64));
+    }
+
+    bool hasPinned() const {
+      for (auto word : mPinnedBits) {
+        if (word) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    size_t cellCount() {
+      return (cellsEnd() - cellsBegin()) / mCellSize;
+    }
+
+    void clearMarks() {
+      std::memset(mMarkBits, 0, sizeof(mMarkBits));
+    }
+
+    GCThing* cellAt(size_t aIndex) {
+      return reinterpret_cast<GCThing*>(reinterpret_cast<uint8_t*>(this) + aIndex * granuleSize);
+    }
+
+    void pushFree(void* aCell) {
+      FreeCell* cell = static_cast<FreeCell*>(aCell);
+      cell->mNext = mFreeList;
+      mFreeList = cell;
+      mFreeCount++;
+    }
+
+    bool isEmpty() {
+      return mFreeCount == cellCount();
+    }
+  };
+
+  ///
+  /// Memory for small arenas is obtained from the system a chunk at a time,
+  /// aligned to the chunk size. The first arena-sized slot of each chunk
+  /// holds this header; the rest are handed out as arenas.
+  ///
+  /// Once a chunk has no arenas in use, its pages can be given back to the
+  /// system while keeping the address range for reuse.
+  ///
+  class Chunk {
+  public:
+    #ifdef AOTJS_HUGE_PAGES
+    static const size_t size = 2 * 1024 * 1024;
+    #else
+    static const size_t size = 1024 * 1024;
+    #endif
+    static const size_t arenaCount = size / Arena::size;
+
+    Chunk* mNext;
+    size_t mFreeArenas;
+    bool mDecommitted;     // whether the pages have been given back
+    uint64_t mFreeBits[arenaCount / 64];
+
+    static Chunk* fromArena(const Arena* aArena) {
+      return reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(aArena) & ~(size - 1));
+    }
+
+    Arena* arenaAt(size_t aIndex) {
+      return reinterpret_cast<Arena*>(reinterpret_cast<uint8_t*>(this) + aIndex * Arena::size);
+    }
+
+    size_t indexOf(const Arena* aArena) const {
+      return (reinterpret_cast<uintptr_t>(aArena) & (size - 1)) / Arena::size;
+    }
+
+    bool isEmpty() const {
+      // Slot 0 is this header.
+      return mFreeArenas == arenaCount - 1;
+    }
+  };
+
+  ///
+  /// Segregated-fit allocator backing all GCThings.
+  ///
+  /// Allocation pops a cell from the first arena of the size class that has
+  /// one free; arenas are created on demand. A cell only counts as allocated
+  /// once the GCThing constructor registers it, so a GC that happens while
+  /// constructor arguments are still being evaluated won't sweep a cell that
+  /// doesn't hold an object yet.
+  ///
+  /// Sweeping is lazy: the GC pause only works out which cells are dead.
+  /// Each size class queues its arenas holding dead objects, and finalizes
+  /// them when it runs out of free cells. With background finalization on,
+  /// a thread runs the destructors instead, and finished arenas get their
+  /// dead cells put back on the free lists the next time one runs out.
+  ///
+  class Heap {
+    struct SizeClass {
+      size_t mCellSize;
+      Arena* mArenas;
+      Arena* mAvailable;
+      Arena* mSweepQueue;
+    };
+
+    static const size_t maxSmallSize = 512;
+    static const size_t sizeClassCount = 20;
+
+    SizeClass mSizeClasses[sizeClassCount];
+    Arena* mLargeArenas;
+    Arena* mLargeSweepQueue;
+
+    Chunk* mChunks;
+    size_t mRetainedBytes;  // empty chunk memory to hold on to for reuse
+
+    #ifdef AOTJS_THREADS
+    // Background finalization. The thread only ever touches dead cells,
+    // and whole dead large arenas; everything else stays with the heap.
+    std::thread mFinalizer;
+    std::mutex mFinalizerLock;
+    std::condition_variable mFinalizerWake;
+    std::condition_variable mFinalizerIdle;
+    bool mBackgroundFinalization;
+    bool mFinalizerBusy;
+    bool mFinalizerStop;
+    Arena* mFinalizeQueue;  // arenas handed to the thread
+    Arena* mFinalized;      // small arenas it's done with
+
+    void finalizerLoop();
+    void waitForFinalizer();
+    void reclaimFinalized();
+    #endif
+
+    static size_t sizeClassIndex(size_t aSize) {
+      // 16-byte steps up to 256, then 64-byte steps up to 512.
+      size_t granules = (aSize + Arena::granuleSize - 1) / Arena::granuleSize;
+      if (granules <= 16) {
+        return granules == 0 ? 0 : granules - 1;
+      } else {
+        return 16 + (granules - 17) / 4;
+      }
+    }
+
+    void* allocateSlow(SizeClass& aClass);
+    void* allocateLarge(size_t aSize);
+    Arena* newArena(size_t aCellSize, size_t aReservedSize);
+    void releaseArena(Arena* aArena);
+    Chunk* newChunk();
+    void releaseChunk(Chunk* aChunk);
+    void makeAvailable(SizeClass& aClass, Arena* aArena);
+    void rebuildAvailable(SizeClass& aClass);
+    void releaseEmptyArenas();
+    void decommitEmptyChunks();
+    static void finalizeDead(Arena* aArena);
+    void reclaimDead(Arena* aArena);
+    void sweepLargeQueue();
+
+  public:
+    #ifdef VAL_COMPRESSED
+    ///
+    /// All GC memory, nursery included, comes from one reserved range of
+    /// cageSize bytes starting here, so a Val can hold a 32-bit offset
+    /// instead of a pointer.
+    ///
+    static uintptr_t cageBase;
+    static const uint64_t cageSize = uint64_t(1) << 32;
+    #endif
+
+    Heap();
+    ~Heap();
+
+    void* allocate(size_t aSize) {
+      if (aSize > maxSmallSize) {
+        return allocateLarge(aSize);
+      }
+      SizeClass& sizeClass = mSizeClasses[sizeClassIndex(aSize)];
+      Arena* arena = sizeClass.mAvailable;
+      if (!arena) {
+        return allocateSlow(sizeClass);
+      }
+      FreeCell* cell = arena->mFreeList;
+      arena->mFreeList = cell->mNext;
+      arena->mFreeCount--;
+      if (!arena->mFreeList) {
+        sizeClass.mAvailable = arena->mNextAvailable;
+        arena->mAvailable = false;
+      }
+      return cell;
+    }
+
+    void free(void* aPtr);
+
+    void registerThing(GCThing& aObj) {
+      Arena::fromPointer(&aObj)->setAllocated(&aObj);
+    }
+
+    ///
+    /// Unlink every unmarked object, queueing it to be destroyed later,
+    /// and clear the marks on the rest. Returns the bytes still in use.
+    ///
+    size_t sweep();
+
+    ///
+    /// Destroy everything queued by sweep() now, and give back any memory
+    /// that frees up.
+    ///
+    void finishSweeping();
+
+    ///
+    /// How much memory in empty chunks to keep for reuse rather than give
+    /// back to the system.
+    ///
+    void setRetainedBytes(size_t aBytes) {
+      mRetainedBytes = aBytes;
+    }
+
+    ///
+    /// First half of compaction: moves every object out of the emptiest
+    /// arenas of each size class into free cells in the rest, for as long
+    /// as there's room, leaving a forwarding pointer in each old cell.
+    /// Arenas with pinned or half-constructed objects stay put. Returns the
+    /// number of objects moved.
+    ///
+    /// Everything must be swept first.
+    ///
+    size_t evacuateSparseArenas();
+
+    ///
+    /// Second half of compaction, once all references have been updated:
+    /// gives back the arenas that were emptied.
+    ///
+    void releaseEvacuated();
+
+    static bool isForwarded(const GCThing* aObj) {
+      return Arena::fromPointer(aObj)->mEvacuated;
+    }
+
+    static GCThing* forwardedAddress(const GCThing* aObj) {
+      return *reinterpret_cast<GCThing* const*>(aObj);
+    }
+
+    ///
+    /// Run destructors of dead objects on a background thread. Only does
+    /// anything on builds with threads.
+    ///
+    void setBackgroundFinalization(bool aEnabled);
+
+    ///
+    /// Call aFunc on every registered object.
+    ///
+    template <typename F>
+    void forEach(F aFunc);
+  };
+
+  ///
+  /// Young generation: one block of memory handed out by bumping a pointer.
+  ///
+  /// Each object is preceded by a header recording its size and state, so a
+  /// minor GC can walk the block and destroy whatever it didn't promote.
+  /// Forwarded objects keep their new address in their first word.
+  ///
+  class Nursery {
+  public:
+    enum State : uint32_t {
+      Unconstructed,
+      Live,
+      Forwarded,
+      Dead
+    };
+
+    struct Header {
+      uint32_t mSize; // including the header
+      uint32_t mState;
+    };
+
+    static const size_t defaultSize = 256 * 1024;
+
+    // Bigger objects go straight to the tenured heap.
+    static const size_t maxObjectSize = 512;
+
+    uint8_t* mBegin;
+    uint8_t* mTop;
+    uint8_t* mLimit; // allocation fails here; may be short of mEnd
+    uint8_t* mEnd;
+
+    // Cells handed out whose constructors haven't registered them yet.
+    // A minor GC can't reuse the block while any of these are pending.
+    size_t mPending;
+
+    Nursery();
+    ~Nursery();
+
+    void init(size_t aSize);
+
+    bool contains(const void* aPtr) const {
+      return reinterpret_cast<uintptr_t>(aPtr) - reinterpret_cast<uintptr_t>(mBegin)
+        < static_cast<uintptr_t>(mEnd - mBegin);
+    }
+
+    void* allocate(size_t aSize) {
+      size_t total = sizeof(Header) + ((aSize + 7) & ~size_t(7));
+      if (static_cast<size_t>(mLimit - mTop) < total) {
+        return nullptr;
+      }
+      Header* header = reinterpret_cast<Header*>(mTop);
+      header->mSize = static_cast<uint32_t>(total);
+      header->mState = Unconstructed;
+      mTop += total;
+      mPending++;
+      return header + 1;
+    }
+
+    ///
+    /// Make allocation fall into the slow path after aBytes more,
+    /// or at the end of the block if that's sooner.
+    ///
+    void setLimit(size_t aBytes) {
+      mLimit = static_cast<size_t>(mEnd - mTop) < aBytes ? mEnd : mTop + aBytes;
+    }
+
+    static Header* headerOf(const void* aPtr) {
+      return reinterpret_cast<Header*>(const_cast<void*>(aPtr)) - 1;
+    }
+
+    void registerThing(GCThing& aObj) {
+      headerOf(&aObj)->mState = Live;
+      mPending--;
+    }
+
+    ///
+    /// Call aFunc on every constructed object not yet promoted or destroyed.
+    ///
+    template <typename F>
+    void forEach(F aFunc) {
+      for (uint8_t* ptr = mBegin; ptr < mTop; ptr += reinterpret_cast<Header*>(ptr)->mSize) {
+        Header* header = reinterpret_cast<Header*>(ptr);
+        if (header->mState == Live) {
+          aFunc(reinterpret_cast<GCThing*>(header + 1));
+        }
+      }
+    }
+  };
+
+  ///
+  /// Visitor over the reference slots a GCThing holds, so the same
+  /// traversal serves marking and moving objects.
+  ///
+  class GCTracer {
+  public:
+    virtual void trace(Val& aSlot) = 0;
+    virtual void trace(GCThing*& aSlot) = 0;
+
+    // Typed pointer slots; may be null.
+    template <class T>
+    void traceThing(T*& aSlot) {
+      GCThing* thing = aSlot;
+      trace(thing);
+      aSlot = static_cast<T*>(thing);
+    }
+  };
+
   ///
   /// Represents an entire JS world.
   ///
@@ -124,23 +628,97 @@ namespace AotJS {
   /// or just let everything deallocate when the engine is
   /// destroyed.
   ///
+  /// New objects are bump-allocated in the nursery; when it fills up a
+  /// minor GC promotes survivors into the tenured arena heap. Roots for a
+  /// minor GC are the Local stack, the root object and the remembered set
+  /// of tenured objects that may point into the nursery, kept up to date
+  /// by writeBarrier(). A full gc() empties the nursery first, then marks
+  /// and sweeps the tenured heap.
+  ///
+  /// Marking works off a stack of gray objects: marked, but with refs not
+  /// yet traced, so deep object graphs don't use up the native stack.
+  ///
+  /// In incremental mode, a collection triggered by allocation only marks
+  /// the roots to start with, then traces a slice of the gray stack for
+  /// every sliceBytes allocated. writeBarrier() shades tenured objects
+  /// stored during marking, and anything tenured during marking starts out
+  /// gray. The final slice promotes the nursery, shading only what marked
+  /// objects refer to, rescans the roots and Cells (which have no barrier),
+  /// then sweeps.
+  ///
   class Engine {
     // Flag to disable GC until we've finished initializing.
-    // We need to be able to create a few sigil objects before
+    // We need to be able to create the root object before
     // it's possible to cleanly run the GC system.
     bool mReadyForGC;
-    size_t mAllocations;
 
-    // Sigil values with special boxed values
-    Box<Undefined>* mUndefined;
-    Box<Null>* mNull;
-    Box<Deleted>* mDeleted;
-    Box<bool>* mFalse;
-    Box<bool>* mTrue;
+    // Tenured bytes allocated (or promoted) since the last GC, and how
+    // many survived it.
+    size_t mAllocatedBytes;
+    size_t mLiveBytes;
+
+    // Trigger policy; see setGCLimits().
+    size_t mMinHeapSize;
+    double mGrowthFactor;
+    size_t mMaxHeapSize;
+
+    // Arena heap holding tenured GCThings.
+    // Must come before the root object, which is allocated from it.
+    Heap mHeap;
+
+    // Young generation; stays empty until the root object is set up,
+    // so it lands in the tenured heap.
+    Nursery mNursery;
+
+    // Tenured objects that had a nursery reference stored into them
+    // since the last minor GC.
+    vector<GCThing*> mRememberedSet;
+
+    // Cells hand out raw Val* bindings that get written without a barrier,
+    // so they're scanned on every minor GC for as long as they live.
+    vector<GCThing*> mRememberedCells;
+
+    // Objects promoted during a minor GC whose refs still need scanning.
+    vector<GCThing*> mPromoted;
+
+    // Incremental marking state.
+    bool mIncremental;
+    bool mMarking;
+    size_t mSliceBudget;
+    size_t mTenuredSinceSlice;
+
+    // Gray objects: marked, with refs still to be traced. Holds at most
+    // mMarkStackLimit entries; past that, objects are only marked, and
+    // mMarkStackOverflowed has the drain rescan the heap to find them.
+    vector<GCThing*> mMarkStack;
+    size_t mMarkStackLimit;
+    bool mMarkStackOverflowed;
+
+    // Threads to mark with during the final pause; 1 means serial.
+    size_t mMarkThreads;
 
     // Global root object.
     Object* mRoot;
 
+    // Interned property names by contents, held weakly: atoms nothing
+    // else marked are dropped before the sweep. Keys point into the
+    // atoms' own characters, which stay put since atoms are pinned.
+    struct AtomKey {
+      const void* mChars;
+      size_t mLength;
+      uint32_t mHash;
+      bool mTwoByte;
+    };
+    struct AtomKeyHash {
+      size_t operator()(const AtomKey& aKey) const {
+        return aKey.mHash;
+      }
+    };
+    struct AtomKeyEqual {
+      bool operator()(const AtomKey& aLhs, const AtomKey& aRhs) const;
+    };
+    unordered_map<AtomKey, String*, AtomKeyHash, AtomKeyEqual> mAtoms;
+
     // a stack of Val cells, to which we keep pointers in vars and 'real' stack.
     // Or, in theory we could scan the real stack but may have false values
     // and could run into problems with values optimized into locals which
@@ -150,12 +728,51 @@ namespace AotJS {
     Val* mStackTop;
     Val* mStackEnd;
 
-    // Set of all live objects.
-    // Todo: replace this with an allocator we know how to walk!
-    unordered_set<GCThing *> mObjects;
+    void* allocateForGC(size_t aSize) {
+      #ifdef FORCE_GC
+      // Force garbage collection to happen on every allocation.
+      // Should shake out some bugs.
+      gc();
+      #endif
+      void* ptr = mNursery.allocate(aSize);
+      if (ptr) {
+        return ptr;
+      }
+      return allocateForGCSlow(aSize);
+    }
+
+    void* allocateForGCSlow(size_t aSize);
+    void* allocateTenuredForGC(size_t aSize);
+    void* allocatePinnedForGC(size_t aSize);
+    size_t gcThreshold() const;
+    void checkHeapLimit(size_t aSize);
+    void freeForGC(void* aPtr);
 
     void registerForGC(GCThing& aObj);
+    void rememberForGC(GCThing& aObj);
+    void rememberCellForGC(Cell& aCell);
+    GCThing* evacuate(GCThing* aObj);
+    void promoteNursery(bool aShadeAll);
+
+    void resetNurseryLimit();
+    void markGray(GCThing* aObj);
+    void pushGray(GCThing* aObj);
+    void markRoots();
+    bool drainMarkStack(size_t aBudget);
+    void rescanMarked();
+    void markParallel();
+    void markSlice(size_t aBudget);
+    void startIncrementalGC();
+    void finishGC();
+
+    String* lookupAtom(const String& aString);
+    String* addAtom(String* aString);
+    void sweepAtoms();
+
     friend class GCThing;
+    friend class Cell;
+    friend class EvacuateTracer;
+    friend class MarkTracer;
 
     friend class Local;
     friend class Scope;
@@ -163,12 +780,34 @@ namespace AotJS {
     template <class T> friend class ScopeRet;
     friend class ArgList;
     Val* stackTop();
+    static Val* newStack(size_t aStackSize);
     Val* pushLocal(Val ref);
     void popLocal(Val* mRecord);
 
   public:
     static const size_t defaultStackSize = 256 * 1024;
 
+    // Incremental marking pace: objects traced per slice, and bytes
+    // allocated between slices.
+    static const size_t defaultSliceBudget = 512;
+    static const size_t sliceBytes = 16 * 1024;
+
+    // Mark stack entries kept before falling back to rescanning the heap,
+    // and how far ahead of tracing objects are taken off it and prefetched.
+    static const size_t defaultMarkStackLimit = 64 * 1024;
+    static const size_t markPrefetchDistance = 8;
+
+    // Objects traced serially before parallel marking is worth starting.
+    static const size_t parallelMarkThreshold = 4096;
+
+    // Memory from empty heap chunks kept ready for reuse.
+    static const size_t defaultRetainedBytes = 4 * Chunk::size;
+
+    // Default trigger policy: collect once the tenured heap has grown to
+    // twice what survived the last GC, but not while it's under 1 MB.
+    static const size_t defaultMinHeapSize = 1024 * 1024;
+    static constexpr double defaultGrowthFactor = 2.0;
+
     // Todo allow specializing the root object at instantiation time?
     Engine(size_t aStackSize);
 
@@ -190,26 +829,129 @@ namespace AotJS {
     }
 
     // Sigil values
-    Box<Undefined>* undefinedRef() const {
-      return mUndefined;
+
+    bool isYoung(const GCThing* aObj) const {
+      return mNursery.contains(aObj);
+    }
+
+    ///
+    /// The interned String with the same contents, shared by every property
+    /// name spelled that way so property maps can key on its address.
+    /// Atoms are tenured and pinned, and are reclaimed once nothing but
+    /// the atom table refers to them.
+    ///
+    Retained<String> atomize(Local aString);
+    Retained<String> atomize(const string& aChars);
+
+    ///
+    /// The existing atom with the same contents as aString, or nullptr.
+    /// Never allocates.
+    ///
+    String* findAtom(const String& aString);
+
+    ///
+    /// Must be called after storing a reference into a GCThing, so tenured
+    /// objects pointing into the nursery are found by the next minor GC.
+    ///
+    void writeBarrier(GCThing& aOwner, const Val& aVal);
+
+    void writeBarrier(GCThing& aOwner, const GCThing* aRef);
+
+    ///
+    /// Promote everything live in the nursery, leaving it empty.
+    ///
+    void minorGC();
+
+    ///
+    /// A collection starts once the tenured heap reaches aGrowthFactor times
+    /// the bytes that survived the last one, or aMinHeapSize if that's more.
+    /// If aMaxHeapSize is non-zero, an allocation that would take the heap
+    /// over it forces an emergency collection first, and aborts if that
+    /// doesn't free enough.
+    ///
+    void setGCLimits(size_t aMinHeapSize,
+                     double aGrowthFactor = defaultGrowthFactor,
+                     size_t aMaxHeapSize = 0);
+
+    ///
+    /// Once a collection leaves whole chunks of the heap empty, keep up to
+    /// aBytes of them for reuse, and give the rest back to the system.
+    ///
+    void setHeapRetention(size_t aBytes) {
+      mHeap.setRetainedBytes(aBytes);
     }
 
-    Box<Null>* nullRef() const {
-      return mNull;
+    ///
+    /// Tenured bytes in use: what survived the last GC plus what's been
+    /// allocated since, dead or not.
+    ///
+    size_t heapSize() const {
+      return mLiveBytes + mAllocatedBytes;
     }
 
-    Box<Deleted>* deletedRef() const {
-      return mDeleted;
+    ///
+    /// Collect everything possible right now, finishing any incremental
+    /// collection and destroying dead objects without waiting for the lazy
+    /// sweep. For when memory is short.
+    ///
+    void emergencyGC();
+
+    ///
+    /// Run a full GC, then move objects out of sparsely used arenas and
+    /// give those back, to undo fragmentation in long-running processes.
+    ///
+    /// Tenured objects otherwise never move, so this must only be called
+    /// where no raw pointers or references to GCThings are held -- only
+    /// Locals, Retained and the root object are updated.
+    ///
+    void compact();
+
+    ///
+    /// Keep a tenured object from ever being moved by compact(), for
+    /// objects whose address matters, like property keys.
+    ///
+    void pinForGC(GCThing& aObj);
+
+    ///
+    /// In incremental mode, collections triggered by allocation are marked
+    /// a slice of aSliceBudget objects at a time instead of all at once.
+    /// Explicit gc() calls always finish in one go.
+    ///
+    void setIncrementalGC(bool aIncremental, size_t aSliceBudget = defaultSliceBudget);
+
+    ///
+    /// Caps the mark stack at aLimit entries. Deep or wide object graphs
+    /// then cost extra heap rescans instead of more memory.
+    ///
+    void setMarkStackLimit(size_t aLimit) {
+      mMarkStackLimit = aLimit;
     }
 
-    Box<bool>* falseRef() const {
-      return mFalse;
+    bool isMarking() const {
+      return mMarking;
     }
 
-    Box<bool>* trueRef() const {
-      return mTrue;
+    ///
+    /// On native builds, destroy dead objects on a background thread
+    /// rather than lazily on the allocating one.
+    ///
+    void setBackgroundFinalization(bool aEnabled) {
+      mHeap.setBackgroundFinalization(aEnabled);
     }
 
+    ///
+    /// On native builds, mark with aThreads threads (including this one)
+    /// during the final pause of each collection. Small heaps are still
+    /// marked serially, as it's not worth starting threads for them.
+    ///
+    void setParallelMarking(size_t aThreads);
+
+    ///
+    /// Do up to aBudget objects' worth of marking now, starting a collection
+    /// if none is in progress. Lets embedders spend idle time on the GC.
+    ///
+    void gcSlice(size_t aBudget);
+
     void gc();
     void maybeGC();
     string dump();
@@ -230,89 +972,147 @@ namespace AotJS {
   ///
   class GCThing {
     ///
-    /// GC mark state -- normally false, except during GC marking
-    /// when it records true if the object is reachable.
+    /// Set while a tenured object is in the engine's remembered set.
     ///
-    bool mMarked;
+    bool mRemembered;
 
-  public:
-    GCThing()
-    :
-      mMarked(false)
+    ///
+    /// Set once at construction by each concrete class.
+    ///
+    GCKind mKind;
+
+    friend class Engine;
+
+  protected:
+    ///
+    /// Used by relocateForGC() implementations; the new copy is registered
+    /// by the GC itself rather than counting as an allocation.
+    ///
+    GCThing(GCThing&& aOther)
+    : mRemembered(false),
+      mKind(aOther.mKind)
     {
-      #ifdef FORCE_GC
-      // Force garbage collection to happen on every allocation.
-      // Should shake out some bugs.
-      engine().gc();
-      #else
-      engine().maybeGC();
-      #endif
+      //
+    }
 
-      // We need a set of *all* allocated objects to do sweep.
-      // todo: put this in the allocator?
+    explicit GCThing(GCKind aKind)
+    :
+      mRemembered(false),
+      mKind(aKind)
+    {
+      // Flag our cell as holding a live object so the sweeper can find it.
+      // Any GC work already happened in operator new.
       engine().registerForGC(*this);
     }
 
+    ///
+    /// For classes whose instances are referenced by raw C++ pointers
+    /// across allocations, and so must never be moved by any GC.
+    ///
+    static void* allocateTenured(size_t aSize);
+
+  public:
+    GCThing()
+    : GCThing(GCKind::GCThing)
+    {
+      //
+    }
+
     virtual ~GCThing();
 
+    // GCThings are allocated in the nursery unless a subclass says otherwise.
+    static void* operator new(size_t aSize);
+    static void operator delete(void* aPtr);
+
     // To be called only by Engine...
 
+    ///
+    /// GC mark state, kept in the arena's mark bitmap: normally false,
+    /// except during GC marking when it records true if the object is
+    /// reachable. Only meaningful for tenured objects.
+    ///
     bool isMarkedForGC() const {
-      return mMarked;
+      return Arena::fromPointer(this)->isMarked(this);
     }
 
-    void markForGC() {
-      if (!isMarkedForGC()) {
-        mMarked = true;
-        #ifdef DEBUG
-        std::cerr << "marking object live " << dump() << "\n";
-        #endif
-        markRefsForGC();
-      }
-    }
+    ///
+    /// Pass each reference slot we hold to the tracer, which may update it.
+    /// Dispatches on the kind, so leaf objects cost only the check.
+    ///
+    void traceRefsForGC(GCTracer& aTracer);
 
-    void clearForGC() {
-      mMarked = false;
-    }
+    ///
+    /// Run the destructor in place, skipping it entirely for kinds that
+    /// have nothing to clean up.
+    ///
+    void finalizeForGC();
 
-    virtual void markRefsForGC();
+    ///
+    /// Move-construct a copy of ourselves at aDest, for promotion out of
+    /// the nursery. The GC destroys the original afterwards.
+    ///
+    virtual GCThing* relocateForGC(void* aDest);
 
     // Really public!
     virtual string dump();
 
-    virtual TypeOf typeOf() const;
+    GCKind kind() const {
+      return mKind;
+    }
+
+    TypeOf typeOf() const;
+
+    bool isInternal() const {
+      return mKind == GCKind::Internal || mKind == GCKind::Cell;
+    }
 
     virtual Retained<String> toString() const;
-    virtual int32_t toInt32() const;
-    virtual double toDouble() const;
+    int32_t toInt32() const;
+    double toDouble() const;
   };
 
   // Internal classes that should not be exposed to JS
   class Internal : public GCThing {
+  protected:
+    Internal(Internal&& aOther) = default;
+
+    explicit Internal(GCKind aKind)
+    : GCThing(aKind)
+    {
+      //
+    }
+
   public:
     Internal()
-    : GCThing()
+    : GCThing(GCKind::Internal)
     {
       //
     }
 
     ~Internal() override;
-    TypeOf typeOf() const override;
   };
 
   ///
   /// Child classes are JS-exposed objects, but not necessarily Objects.
   ///
   class JSThing : public GCThing {
+  protected:
+    JSThing(JSThing&& aOther) = default;
+
+    explicit JSThing(GCKind aKind)
+    : GCThing(aKind)
+    {
+      //
+    }
+
   public:
     JSThing()
-    : GCThing()
+    : GCThing(GCKind::JSThing)
     {
       //
     }
 
     ~JSThing() override;
-    TypeOf typeOf() const override;
 
     Retained<String> toString() const override;
   };
@@ -322,27 +1122,36 @@ namespace AotJS {
     T mVal;
 
   public:
-    Box(T aVal) : mVal(aVal) {}
-
-    T val() const {
-      return mVal;
-    }
+    Box(T aVal) : GCThing(boxKind<T>()), mVal(aVal) {}
+    Box(Box&& aOther) = default;
 
-    int32_t toInt32() const override {
-      return static_cast<int32_t>(val());
+    GCThing* relocateForGC(void* aDest) override {
+      return ::new (aDest) Box<T>(std::move(*this));
     }
 
-    double toDouble() const override {
-      return static_cast<double>(val());
+    T val() const {
+      return mVal;
     }
 
-    TypeOf typeOf() const override;
-
     string dump() override;
   };
 
-  //#define VAL_TAGGED_POINTER 1
+  // Pick the Val layout with -DVAL_TAGGED_POINTER, -DVAL_COMPRESSED or
+  // -DVAL_SHIFTED_NAN_BOX; NaN-boxing is the default. VAL_COMPRESSED is the
+  // tagged-pointer layout with 32-bit offsets into the heap's cage in place
+  // of pointers, for 64-bit native builds.
+  #ifdef VAL_COMPRESSED
+  #ifndef AOTJS_MMAP
+  #error "VAL_COMPRESSED needs the mmap'd heap"
+  #endif
+  #define VAL_TAGGED_POINTER 1
+  #endif
+
+  #if defined(VAL_TAGGED_POINTER) && defined(VAL_SHIFTED_NAN_BOX)
+  #error "only one Val layout can be selected"
+  #elif !defined(VAL_TAGGED_POINTER)
   #define VAL_SHIFTED_NAN_BOX 1
+  #endif
 
   class Val {
     #ifdef VAL_TAGGED_POINTER
@@ -353,8 +1162,8 @@ namespace AotJS {
     ///
     /// Unlike NaN-boxing this means double-precision floats and some int32s
     /// must be boxed into GCThing subclasses and allocated on the heap.
-    /// Other values like undefined, null, and boolean use special sigil
-    /// objects that don't have to be allocated on each use.
+    /// Other values like undefined, null, and boolean are immediates with
+    /// 10 in the low bits, which no GCThing pointer can have.
     ///
     /// However it is closer to the available reference types in the Wasm
     /// garbage collection proposal: https://github.com/WebAssembly/gc/pull/34
@@ -362,58 +1171,107 @@ namespace AotJS {
     /// references.
     ///
     /// And I don't expect high-performance float math to be a big use case
-    /// for this plugin model, so we'll live with the boxing.
-    union {
-      size_t mRaw;
-      GCThing* mPtr;
-    };
+    /// for this plugin model, so we'll live with the boxing. Doubles that
+    /// hold an int31 are stored as one, so integer math mostly avoids it.
+    ///
+    /// On wasm32 this makes a Val half the size of a NaN-boxed one. With
+    /// VAL_COMPRESSED, 64-bit builds get the same by storing pointers as
+    /// offsets from Heap::cageBase.
+    #ifdef VAL_COMPRESSED
+    typedef uint32_t Raw;
+    #else
+    typedef size_t Raw;
+    #endif
 
-    static size_t tagPointer(GCThing *aPtr) {
-      return reinterpret_cast<size_t>(aPtr);
+    Raw mRaw;
+
+    static const Raw tagMask          = 3;
+    static const Raw tagBitsImmediate = 2;
+
+    static const Raw rawUndefined = (0 << 2) | tagBitsImmediate;
+    static const Raw rawNull      = (1 << 2) | tagBitsImmediate;
+    static const Raw rawFalse     = (2 << 2) | tagBitsImmediate;
+    static const Raw rawTrue      = (3 << 2) | tagBitsImmediate;
+    static const Raw rawDeleted   = (4 << 2) | tagBitsImmediate;
+
+    #ifdef VAL_COMPRESSED
+    static Raw tagPointer(GCThing *aPtr) {
+      return static_cast<Raw>(reinterpret_cast<uintptr_t>(aPtr) - Heap::cageBase);
+    }
+
+    GCThing* asPointer() const {
+      return reinterpret_cast<GCThing*>(Heap::cageBase + mRaw);
+    }
+    #else
+    static Raw tagPointer(GCThing *aPtr) {
+      return reinterpret_cast<Raw>(aPtr);
     }
 
+    GCThing* asPointer() const {
+      return reinterpret_cast<GCThing*>(mRaw);
+    }
+    #endif
+
+    static const int32_t int31Min = -(1 << 30);
+    static const int32_t int31Max = (1 << 30) - 1;
+
     static bool isValidInt31(int32_t aInt) {
-      return ((aInt << 1) >> 1) == aInt;
+      return aInt >= int31Min && aInt <= int31Max;
     }
 
-    static size_t tagInt31(int32_t aInt) {
-       return static_cast<size_t>((aInt << 1) | 1);
+    static Raw tagInt31(int32_t aInt) {
+       return static_cast<Raw>((static_cast<uint32_t>(aInt) << 1) | 1);
     }
 
-    static size_t tagOrBoxInt32(int32_t aInt) {
+    static Raw tagOrBoxInt32(int32_t aInt) {
       if (isValidInt31(aInt)) {
         return tagInt31(aInt);
       } else {
-        return reinterpret_cast<size_t>(new Box<int32_t>(aInt));
+        return tagPointer(new Box<int32_t>(aInt));
       }
     }
 
-    static size_t tagOrBoxDouble(double aDouble) {
-      return reinterpret_cast<size_t>(new Box<double>(aDouble));
-    }
-
-    static int32_t derefInt31(size_t aRaw) {
-      return static_cast<int32_t>(reinterpret_cast<size_t>(aRaw)) >> 1;
+    static Raw tagOrBoxDouble(double aDouble) {
+      // Range check first, so the cast is defined; -0 has to stay boxed.
+      if (aDouble >= int31Min && aDouble <= int31Max) {
+        int32_t asInt = static_cast<int32_t>(aDouble);
+        if (asInt == aDouble && (asInt != 0 || !std::signbit(aDouble))) {
+          return tagInt31(asInt);
+        }
+      }
+      return tagPointer(new Box<double>(aDouble));
     }
 
-    GCThing* asPointer() const {
-      return mPtr;
+    static int32_t derefInt31(Raw aRaw) {
+      return static_cast<int32_t>(static_cast<uint32_t>(aRaw)) >> 1;
     }
     #endif
 
     #ifdef VAL_SHIFTED_NAN_BOX
     // JavaScriptCore-style NaN boxing.
-    // Value is shifted with an addition to turn NaNs into 0s.
+    // Doubles are biased by 2^49, which moves the top of the negative NaN
+    // range onto the 0x0000, 0x0001 and 0xffff tags and leaves every
+    // other double, -Infinity included, inline in between.
     union {
       int64_t mRaw;
     };
 
-    static const int64_t tagShift       = 0x0010'0000'0000'0000;
+    static const int64_t tagShift       = 0x0002'0000'0000'0000;
     static const int64_t tagMask        = 0xffff'0000'0000'0000;
     static const int64_t tagBitShift    = 48;
     static const int64_t tagBitsPointer = 0;
     static const int64_t tagBitsInt32   = -1;
 
+    // Undefined, null, booleans and deleted live in a tag no double
+    // can have once NaNs are canonicalized.
+    static const int64_t tagBitsImmediate = 1;
+
+    static const int64_t rawUndefined = (tagBitsImmediate << tagBitShift) | 0;
+    static const int64_t rawNull      = (tagBitsImmediate << tagBitShift) | 1;
+    static const int64_t rawFalse     = (tagBitsImmediate << tagBitShift) | 2;
+    static const int64_t rawTrue      = (tagBitsImmediate << tagBitShift) | 3;
+    static const int64_t rawDeleted   = (tagBitsImmediate << tagBitShift) | 4;
+
     GCThing* asPointer() const {
       return reinterpret_cast<GCThing*>(mRaw);
     }
@@ -430,11 +1288,15 @@ namespace AotJS {
     }
 
     static int64_t tagOrBoxDouble(double aDouble) {
-      if (aDouble == -INFINITY) {
-        // turns into 0 with our bitshift
-        return tagPointer(new Box<double>(aDouble));
+      // Never actually boxes; the name matches the tagged-pointer layout.
+      if (aDouble != aDouble) {
+        // Some NaN payloads would land on the pointer, immediate or int32
+        // tags. JS can't tell NaNs apart, so they all become one.
+        double canonical = NAN;
+        return static_cast<int64_t>(*reinterpret_cast<uint64_t*>(&canonical) + tagShift);
       } else {
-        return *reinterpret_cast<int64_t*>(&aDouble) + tagShift;
+        // Add unsigned; only NaNs would wrap past the top of the range.
+        return static_cast<int64_t>(*reinterpret_cast<uint64_t*>(&aDouble) + tagShift);
       }
     }
     #endif
@@ -456,10 +1318,10 @@ namespace AotJS {
     Val(const GCThing* aRef)  : Val(const_cast<GCThing*>(aRef)) {} // don't use null pointers!
     Val(double aDouble)       : mRaw(tagOrBoxDouble(aDouble)) {}
     Val(int32_t aInt)         : mRaw(tagOrBoxInt32(aInt)) {};
-    Val(bool aBool)           : Val(aBool ? engine().trueRef() : engine().falseRef()) {}
-    Val(Null aNull)           : Val(engine().nullRef()) {}
-    Val(Undefined aUndefined) : Val(engine().undefinedRef()) {}
-    Val(Deleted aDeleted)     : Val(engine().deletedRef()) {}
+    Val(bool aBool)           : mRaw(aBool ? rawTrue : rawFalse) {}
+    Val(Null aNull)           : mRaw(rawNull) {}
+    Val(Undefined aUndefined) : mRaw(rawUndefined) {}
+    Val(Deleted aDeleted)     : mRaw(rawDeleted) {}
 
     Val(const Val &aVal) : mRaw(aVal.raw()) {}
     Val(Val &aVal)       : mRaw(aVal.raw()) {}
@@ -471,7 +1333,7 @@ namespace AotJS {
     }
 
     #ifdef VAL_TAGGED_POINTER
-    size_t raw() const {
+    Raw raw() const {
       return mRaw;
     }
 
@@ -484,15 +1346,23 @@ namespace AotJS {
     }
 
     bool isGCThing() const {
-      return !tag();
+      return (mRaw & tagMask) == 0;
+    }
+
+    bool isImmediate() const {
+      return (mRaw & tagMask) == tagBitsImmediate;
     }
 
     bool isDouble() const {
-      return false; // not supported in pointer tag
+      return isKind(GCKind::BoxDouble);
     }
 
     bool isInt32() const {
-      return false; // not supported in pointer tag
+      return isInt31() || isKind(GCKind::BoxInt32);
+    }
+
+    bool isNumber() const {
+      return isInt31() || isKind(GCKind::BoxDouble) || isKind(GCKind::BoxInt32);
     }
     #endif
 
@@ -509,9 +1379,13 @@ namespace AotJS {
       return tag() == tagBitsPointer;
     }
 
+    bool isImmediate() const {
+      return tag() == tagBitsImmediate;
+    }
+
     bool isDouble() const {
-      int64_t tag_ = tag();
-      return tag_ != tagBitsPointer && tag_ != tagBitsInt32;
+      // The int32, pointer and immediate tags are -1, 0 and 1.
+      return static_cast<uint64_t>(tag() - tagBitsInt32) > tagBitsImmediate - tagBitsInt32;
     }
 
     bool isInt31() const {
@@ -522,57 +1396,77 @@ namespace AotJS {
       return tag() == tagBitsInt32;
     }
 
+    bool isNumber() const {
+      return !isGCThing() && !isImmediate();
+    }
+
     #endif
 
     bool isTypeOf(TypeOf aExpected) const {
       return isGCThing() && (asPointer()->typeOf() == aExpected);
     }
 
+    bool isKind(GCKind aKind) const {
+      return isGCThing() && (asPointer()->kind() == aKind);
+    }
+
     bool isBool() const {
-      return (asPointer() == engine().trueRef()) || (asPointer() == engine().falseRef());
+      // true and false differ in a single bit.
+      return (mRaw & ~(rawTrue ^ rawFalse)) == rawFalse;
     }
 
     bool isUndefined() const {
-      return (asPointer() == engine().undefinedRef());
+      return mRaw == rawUndefined;
     }
 
     bool isNull() const {
-      return (asPointer() == engine().nullRef());
+      return mRaw == rawNull;
+    }
+
+    bool isDeleted() const {
+      return mRaw == rawDeleted;
     }
 
     bool isInternal() const {
-      return isGCThing() && isTypeOf(typeOfInternal);
+      return isGCThing() && asPointer()->isInternal();
     }
 
     bool isJSThing() const {
-      return isGCThing() && !isTypeOf(typeOfInternal);
+      return isGCThing() && !asPointer()->isInternal();
     }
 
     bool isObject() const {
-      return isTypeOf(typeOfObject);
+      return isKind(GCKind::Object);
     }
 
     bool isString() const {
-      return isTypeOf(typeOfString);
+      return isKind(GCKind::String);
     }
 
     bool isSymbol() const {
-      return isTypeOf(typeOfSymbol);
+      return isKind(GCKind::Symbol);
     }
 
     bool isFunction() const {
-      return isTypeOf(typeOfFunction);
+      return isKind(GCKind::Function);
+    }
+
+    ///
+    /// Compared by identity: objects, functions and symbols, but not the
+    /// strings and boxed numbers that also live on the heap.
+    ///
+    bool isReference() const {
+      return isGCThing() && !isString() && !isNumber();
     }
 
     #ifdef VAL_TAGGED_POINTER
     double asDouble() const {
-      // cannot happen
-      return NAN;
+      return static_cast<Box<double>*>(asPointer())->val();
     }
     #endif
     #ifdef VAL_SHIFTED_NAN_BOX
     double asDouble() const {
-      int64_t shifted = mRaw - tagShift;
+      uint64_t shifted = static_cast<uint64_t>(mRaw) - tagShift;
       return *reinterpret_cast<double*>(&shifted);
     }
     #endif
@@ -583,8 +1477,10 @@ namespace AotJS {
     }
 
     int32_t asInt32() const {
-      // not supported
-      return false;
+      if (isInt31()) {
+        return asInt31();
+      }
+      return static_cast<Box<int32_t>*>(asPointer())->val();
     }
     #endif
 
@@ -599,7 +1495,7 @@ namespace AotJS {
     #endif
 
     bool asBool() const {
-      return reinterpret_cast<Box<bool>*>(asPointer())->val();
+      return mRaw == rawTrue;
     }
 
     Null asNull() const {
@@ -655,23 +1551,55 @@ namespace AotJS {
     // Checked conversions
     bool toBool() const;
     int32_t toInt32() const;
+    uint32_t toUint32() const;
     double toDouble() const;
     Retained<String> toString() const;
 
+    ///
+    /// SameValueZero, as used for property keys: numbers and strings by
+    /// value, with NaN matching itself, and everything else by identity.
+    ///
     bool operator==(const Val& rhs) const;
 
-    string dump() const;
+    ///
+    /// JS === and ==. Neither allocates, so they're safe anywhere.
+    ///
+    bool strictEquals(const Val& rhs) const;
+    bool looseEquals(const Val& rhs) const;
 
-    void markForGC() const {
-      if (isGCThing()) {
-        asGCThing().markForGC();
-      }
-    }
+    string dump() const;
 
     Local call(Local aThis, RawArgList aArgs) const;
 
+  private:
+    double immediateToDouble() const;
   };
 
+  #ifdef VAL_COMPRESSED
+  static_assert(sizeof(Val) == 4, "compressed Vals should be 32 bits");
+  #endif
+
+  inline void Engine::writeBarrier(GCThing& aOwner, const GCThing* aRef) {
+    if (!aRef) {
+      return;
+    }
+    if (isYoung(aRef)) {
+      // Generational: remember tenured objects pointing into the nursery.
+      if (!isYoung(&aOwner)) {
+        rememberForGC(aOwner);
+      }
+    } else if (mMarking && !aRef->isMarkedForGC()) {
+      // Incremental: the owner may already be traced, so shade the target.
+      markGray(const_cast<GCThing*>(aRef));
+    }
+  }
+
+  inline void Engine::writeBarrier(GCThing& aOwner, const Val& aVal) {
+    if (aVal.isGCThing()) {
+      writeBarrier(aOwner, &aVal.asGCThing());
+    }
+  }
+
   class SmartVal {
   protected:
     // The smart pointer contains a single pointer word to the value we want
@@ -702,6 +1630,12 @@ namespace AotJS {
   /// so while we're in the scope they stay alive during GC. When we go out
   /// of scope we pop back off the stack in correct order.
   ///
+  /// A Local follows its object when a minor GC moves it; a raw reference
+  /// doesn't. So never allocate while holding one from `->asObject()` and
+  /// friends, including in the arguments of a member call made through
+  /// it, like `x->asObject().foo(String::create("y"))`. That's why
+  /// allocating methods are static and take their receiver as a Local.
+  ///
   class Local : public SmartVal {
   public:
 
@@ -725,7 +1659,7 @@ namespace AotJS {
     /// some explicit constructors.
     Local(bool aVal)      : Local(Val(aVal)) {}
     Local(int32_t aVal)   : Local(Val(aVal)) {}
-    Local(double aVal)    : Local(Val(aVal)) {}
+    Local(double aVal);
     Local(Undefined aVal) : Local(Val(aVal)) {}
     Local(Null aVal)      : Local(Val(aVal)) {}
     Local(GCThing* aVal)  : Local(Val(aVal)) {}
@@ -750,6 +1684,12 @@ namespace AotJS {
       //
     }
 
+    ///
+    /// Materialize an expression result. Explicit, so a Temp never turns
+    /// into a Local behind the back of overload resolution.
+    ///
+    explicit Local(const Temp& aTemp);
+
     ///
     /// Override the = operator for natural use as a binding.
     ///
@@ -758,37 +1698,237 @@ namespace AotJS {
       return *this;
     }
 
+    ///
+    /// Store an expression result straight into our record, without
+    /// pushing a new one.
+    ///
+    Local& operator=(const Temp& aTemp);
+
+    ///
+    /// Store a number straight into our record too. These are templates
+    /// so they only take an exact double or int32_t, such as the result of
+    /// -, * or /, and leave every other type to the Local constructors.
+    ///
+    template <class T, typename std::enable_if<std::is_same<T, double>::value, int>::type = 0>
+    Local& operator=(T aDouble) {
+      return *this = Temp(aDouble);
+    }
+
+    template <class T, typename std::enable_if<std::is_same<T, int32_t>::value, int>::type = 0>
+    Local& operator=(T aInt32) {
+      *mRecord = Val(aInt32);
+      return *this;
+    }
+
+  };
+
+  ///
+  /// An unrooted intermediate result of operator+, which may be a number
+  /// or a string. Numbers are carried as a plain double, so arithmetic
+  /// chains never touch the Local stack; a string result lives in a Local
+  /// record in the enclosing scope, like a ScopeRetVal's return value.
+  ///
+  /// The -, * and / operators already return plain doubles. Store either
+  /// into a Local to keep it.
+  ///
+  class Temp {
+    double mDouble;
+    Val* mRecord;
+
+  public:
+    explicit Temp(double aDouble)
+    : mDouble(aDouble),
+      mRecord(nullptr)
+    {
+      //
+    }
+
+    explicit Temp(const Local& aLocal)
+    : mDouble(0.0),
+      mRecord(&*aLocal)
+    {
+      //
+    }
+
+    bool isString() const {
+      return mRecord && mRecord->isString();
+    }
+
+    double toDouble() const {
+      return mRecord ? mRecord->toDouble() : mDouble;
+    }
+
+    ///
+    /// The value to store. Integral doubles come back int32-tagged, as
+    /// the int32 operators would have left them; -0 stays a double.
+    ///
+    Val toVal() const {
+      if (mRecord) {
+        return *mRecord;
+      }
+      // Range check first, so the cast is defined.
+      if (mDouble >= INT32_MIN && mDouble <= INT32_MAX) {
+        int32_t asInt = static_cast<int32_t>(mDouble);
+        if (asInt == mDouble && (asInt != 0 || !std::signbit(mDouble))) {
+          return Val(asInt);
+        }
+      }
+      return Val(mDouble);
+    }
   };
 
-  Local operator+(Local lhs, Local rhs);
-  Local operator+(double lhs, Local rhs);
-  Local operator+(Local lhs, double rhs);
+  inline Local::Local(const Temp& aTemp)
+  : Local(aTemp.toVal())
+  {
+    //
+  }
+
+  inline Local::Local(double aVal)
+  : Local(Temp(aVal).toVal())
+  {
+    // Tagged the same way as assigning the double would be.
+  }
+
+  inline Local& Local::operator=(const Temp& aTemp) {
+    *mRecord = aTemp.toVal();
+    return *this;
+  }
+
+  Temp operator+(Local lhs, Local rhs);
+  Temp operator+(double lhs, Local rhs);
+  Temp operator+(Local lhs, double rhs);
+  Temp operator+(Temp lhs, Local rhs);
+  Temp operator+(Local lhs, Temp rhs);
+  Temp operator+(Temp lhs, double rhs);
+  Temp operator+(double lhs, Temp rhs);
+  Temp operator+(Temp lhs, Temp rhs);
   double operator-(Local lhs, Local rhs);
   double operator-(double lhs, Local rhs);
   double operator-(Local lhs, double rhs);
+  double operator-(Temp lhs, Local rhs);
+  double operator-(Local lhs, Temp rhs);
+  double operator-(Temp lhs, double rhs);
+  double operator-(double lhs, Temp rhs);
+  double operator-(Temp lhs, Temp rhs);
   double operator*(Local lhs, Local rhs);
   double operator*(double lhs, Local rhs);
   double operator*(Local lhs, double rhs);
+  double operator*(Temp lhs, Local rhs);
+  double operator*(Local lhs, Temp rhs);
+  double operator*(Temp lhs, double rhs);
+  double operator*(double lhs, Temp rhs);
+  double operator*(Temp lhs, Temp rhs);
   double operator/(Local lhs, Local rhs);
   double operator/(double lhs, Local rhs);
   double operator/(Local lhs, double rhs);
+  double operator/(Temp lhs, Local rhs);
+  double operator/(Local lhs, Temp rhs);
+  double operator/(Temp lhs, double rhs);
+  double operator/(double lhs, Temp rhs);
+  double operator/(Temp lhs, Temp rhs);
   bool operator==(Local lhs, Local rhs);
+  bool operator==(double lhs, Local rhs);
+  bool operator==(Local lhs, double rhs);
+  bool operator!=(Local lhs, Local rhs);
+  bool operator!=(double lhs, Local rhs);
+  bool operator!=(Local lhs, double rhs);
+
+  /// JS ===, which has no C++ operator.
+  bool strictEquals(Local lhs, Local rhs);
+  bool strictEquals(double lhs, Local rhs);
+  bool strictEquals(Local lhs, double rhs);
+
   bool operator<(Local lhs, Local rhs);
   bool operator<(double lhs, Local rhs);
   bool operator<(Local lhs, double rhs);
+  bool operator<(Temp lhs, Local rhs);
+  bool operator<(Local lhs, Temp rhs);
+  bool operator<(Temp lhs, double rhs);
+  bool operator<(double lhs, Temp rhs);
+  bool operator<(Temp lhs, Temp rhs);
   bool operator>(Local lhs, Local rhs);
   bool operator>(double lhs, Local rhs);
   bool operator>(Local lhs, double rhs);
+  bool operator>(Temp lhs, Local rhs);
+  bool operator>(Local lhs, Temp rhs);
+  bool operator>(Temp lhs, double rhs);
+  bool operator>(double lhs, Temp rhs);
+  bool operator>(Temp lhs, Temp rhs);
+  bool operator<=(Local lhs, Local rhs);
+  bool operator<=(double lhs, Local rhs);
+  bool operator<=(Local lhs, double rhs);
+  bool operator<=(Temp lhs, Local rhs);
+  bool operator<=(Local lhs, Temp rhs);
+  bool operator<=(Temp lhs, double rhs);
+  bool operator<=(double lhs, Temp rhs);
+  bool operator<=(Temp lhs, Temp rhs);
+  bool operator>=(Local lhs, Local rhs);
+  bool operator>=(double lhs, Local rhs);
+  bool operator>=(Local lhs, double rhs);
+  bool operator>=(Temp lhs, Local rhs);
+  bool operator>=(Local lhs, Temp rhs);
+  bool operator>=(Temp lhs, double rhs);
+  bool operator>=(double lhs, Temp rhs);
+  bool operator>=(Temp lhs, Temp rhs);
 
   Local& operator++(Local& aLocal);
   Local& operator--(Local& aLocal);
-  Local operator++(Local& aLocal, int);
-  Local operator--(Local& aLocal, int);
+  double operator++(Local& aLocal, int);
+  double operator--(Local& aLocal, int);
 
   Local& operator+=(Local& lhs, const Local& rhs);
   Local& operator-=(Local& lhs, const Local& rhs);
   Local& operator*=(Local& lhs, const Local& rhs);
   Local& operator/=(Local& lhs, const Local& rhs);
+
+  ///
+  /// JS ToInt32 and ToUint32: wrap modulo 2^32, with NaN and the
+  /// infinities going to 0.
+  ///
+  int32_t toInt32(double aDouble);
+  uint32_t toUint32(double aDouble);
+
+  ///
+  /// JS Number.prototype.toString in base 10: the shortest digits that
+  /// read back as the same double. Writes up to maxNumberLength chars,
+  /// unterminated, and returns how many.
+  ///
+  const size_t maxNumberLength = 32;
+  size_t numberToString(double aNumber, char* aBuffer);
+
+  ///
+  /// JS ToNumber on a string: decimal, Infinity or a 0x/0o/0b integer,
+  /// with surrounding whitespace ignored. Anything else is NaN.
+  ///
+  double stringToNumber(const char* aChars, size_t aLength);
+
+  int32_t operator&(Local lhs, Local rhs);
+  int32_t operator&(double lhs, Local rhs);
+  int32_t operator&(Local lhs, double rhs);
+  int32_t operator|(Local lhs, Local rhs);
+  int32_t operator|(double lhs, Local rhs);
+  int32_t operator|(Local lhs, double rhs);
+  int32_t operator^(Local lhs, Local rhs);
+  int32_t operator^(double lhs, Local rhs);
+  int32_t operator^(Local lhs, double rhs);
+  int32_t operator~(Local aLocal);
+  int32_t operator<<(Local lhs, Local rhs);
+  int32_t operator<<(double lhs, Local rhs);
+  int32_t operator<<(Local lhs, double rhs);
+  int32_t operator>>(Local lhs, Local rhs);
+  int32_t operator>>(double lhs, Local rhs);
+  int32_t operator>>(Local lhs, double rhs);
+
+  /// JS >>>, which has no C++ operator. The result may not fit an int32.
+  double unsignedShiftRight(Local lhs, Local rhs);
+  double unsignedShiftRight(double lhs, Local rhs);
+  double unsignedShiftRight(Local lhs, double rhs);
+
+  Local& operator&=(Local& lhs, const Local& rhs);
+  Local& operator|=(Local& lhs, const Local& rhs);
+  Local& operator^=(Local& lhs, const Local& rhs);
+  Local& operator<<=(Local& lhs, const Local& rhs);
+  Local& operator>>=(Local& lhs, const Local& rhs);
   // ... etc ...
 
 
@@ -929,7 +2069,9 @@ namespace AotJS {
       std::cerr << "escaping<T> (" << aVal->dump() << ")\n";
       #endif
       mRetVal = aVal;
-      return Retained<T>(&*mRetVal);
+      // Share the record saved in the parent scope; a new Retained would
+      // push one in ours, which is about to be popped.
+      return mRetVal;
     }
   };
 
@@ -967,57 +2109,307 @@ namespace AotJS {
   };
 
   class PropIndex : public JSThing {
+  protected:
+    PropIndex(PropIndex&& aOther) = default;
+
+    explicit PropIndex(GCKind aKind)
+    : JSThing(aKind) {}
+
   public:
-    PropIndex()
-    : JSThing() {}
 
     ~PropIndex() override;
   };
 
+  ///
+  /// An immutable JS string of UTF-16 code units. Flat strings keep their
+  /// characters after the header inline in the same GC cell, so there's one
+  /// allocation per string and the contents move with it. They're stored a
+  /// byte each as Latin-1 when every unit fits, which is most of the time,
+  /// or else two bytes each, with a NUL unit after. Concatenation may make
+  /// a Rope instead, and taking part of a string a Slice. The hash is
+  /// computed on first use and kept.
+  ///
+  /// The cell is sized for the contents, so make them with create() rather
+  /// than new.
+  ///
   class String : public PropIndex {
-    string data;
+  protected:
+    enum class Shape : uint8_t {
+      Flat,
+      Rope,
+      Slice
+    };
 
-  public:
-    String(string const &aStr)
-    : PropIndex(),
-      data(aStr)
-    {
-      //
+  private:
+    // Small fields first, to pack into the end of GCThing.
+    bool mAtom;
+    bool mTwoByte;
+    Shape mShape;
+    uint32_t mLength;
+    mutable uint32_t mHash; // 0 until computed
+
+    friend class Engine;
+    friend class Rope;
+    friend class Slice;
+
+    const void* flatChars() const;
+    uint32_t computeHash() const;
+    bool equalChars(const String& rhs) const;
+
+    static bool equalUnits(const void* aLhs, bool aLhsTwoByte,
+      const void* aRhs, bool aRhsTwoByte, size_t aLength);
+
+  protected:
+    String(size_t aLength, bool aTwoByte, Shape aShape);
+
+    void* buffer() {
+      return this + 1;
+    }
+
+    ///
+    /// The characters, as Latin-1 bytes or char16_ts by isTwoByte().
+    /// Flattens a Rope, which doesn't allocate on the GC heap.
+    ///
+    const void* rawChars() const {
+      if (mShape == Shape::Flat) {
+        return this + 1;
+      }
+      return flatChars();
     }
 
+    ///
+    /// A String with room for aLength chars, which the caller must fill in
+    /// before anything else allocates.
+    ///
+    static String* allocate(size_t aLength, bool aTwoByte, bool aTenured);
+
+  public:
+    // The longest string we'll make; anything longer aborts.
+    static const size_t maxLength = (size_t(1) << 30) - 1;
+
+    String(String&& aOther) = default;
+
     ~String() override;
 
-    TypeOf typeOf() const override;
+    ///
+    /// A String from UTF-8 text. Malformed sequences become U+FFFD.
+    ///
+    static String* create(const char* aChars, size_t aLength);
+
+    static String* create(const char* aChars) {
+      return create(aChars, std::strlen(aChars));
+    }
 
-    string str() const {
-      return data;
+    static String* create(const string& aStr) {
+      return create(aStr.data(), aStr.size());
     }
 
+    ///
+    /// A String from UTF-16 code units, stored as Latin-1 if they fit.
+    ///
+    static String* create(const char16_t* aUnits, size_t aLength);
+
+    ///
+    /// The two strings joined: a Rope if that saves copying, or else a
+    /// flat copy.
+    ///
+    static Retained<String> concat(Local aLhs, Local aRhs);
+
+    ///
+    /// aLength chars of aString from aStart, which must be in range: a
+    /// Slice sharing its characters if that's worth it, or else a copy.
+    ///
+    static Retained<String> range(Local aString, size_t aStart, size_t aLength);
+
+    ///
+    /// JS String.prototype.substring, slice, trim and charAt.
+    ///
+    static Retained<String> substring(Local aString, double aStart, double aEnd);
+    static Retained<String> slice(Local aString, double aStart, double aEnd);
+    static Retained<String> trim(Local aString);
+    static Retained<String> charAt(Local aString, size_t aIndex);
+
+    GCThing* relocateForGC(void* aDest) override;
+
+    ///
+    /// A copy allocated straight into the tenured heap.
+    ///
+    String* tenuredCopy() const;
+
+    ///
+    /// The contents as UTF-8; unpaired surrogates become U+FFFD.
+    ///
+    string str() const;
+
     string dump() override;
 
+    ///
+    /// Length in UTF-16 code units, as in JS.
+    ///
     size_t length() const {
-      return data.size();
+      return mLength;
     }
 
-    operator string() const {
-      return data;
+    bool isTwoByte() const {
+      return mTwoByte;
+    }
+
+    bool isRope() const {
+      return mShape == Shape::Rope;
+    }
+
+    bool isSlice() const {
+      return mShape == Shape::Slice;
+    }
+
+    ///
+    /// The contents, valid until the next allocation may move us, by
+    /// isTwoByte(). Only length() of them are ours; a Slice's run on into
+    /// its parent's.
+    ///
+    const uint8_t* latin1Chars() const {
+      return static_cast<const uint8_t*>(rawChars());
+    }
+
+    const char16_t* twoByteChars() const {
+      return static_cast<const char16_t*>(rawChars());
+    }
+
+    ///
+    /// The code unit at aIndex, which must be in range.
+    ///
+    char16_t charCodeAt(size_t aIndex) const {
+      const void* chars = rawChars();
+      return mTwoByte
+        ? static_cast<const char16_t*>(chars)[aIndex]
+        : static_cast<const uint8_t*>(chars)[aIndex];
+    }
+
+    ///
+    /// Write the contents to aDest, one or two bytes a unit by aTwoByte,
+    /// without flattening. Narrowing is only allowed if every unit fits.
+    ///
+    void copyChars(void* aDest, bool aTwoByte) const;
+
+    void traceRefs(GCTracer& aTracer);
+
+    ///
+    /// FNV-1a over the code units, however they're stored; never 0.
+    ///
+    uint32_t hash() const {
+      if (!mHash) {
+        mHash = computeHash();
+      }
+      return mHash;
+    }
+
+    ///
+    /// Whether this is the Engine's interned copy of its contents.
+    ///
+    bool isAtom() const {
+      return mAtom;
     }
 
     Retained<String> toString() const override {
       ScopeRet<String> scope;
       #ifdef DEBUG
-      std::cerr << "toString for string: " << data << "\n";
+      std::cerr << "toString for string: " << str() << "\n";
       #endif
       return scope.escape(this);
     }
 
     bool operator==(const String &rhs) const {
-      return data == rhs.data;
+      // Known hashes that differ settle it without reading the contents.
+      return mLength == rhs.mLength &&
+        (!mHash || !rhs.mHash || mHash == rhs.mHash) &&
+        equalChars(rhs);
     }
 
-    Retained<String> operator+(const String &rhs) const {
-      ScopeRet<String> scope;
-      return scope.escape(new String(data + rhs.data));
+    ///
+    /// Lexicographic order by code unit, as JS compares strings.
+    ///
+    int compare(const String &rhs) const;
+
+    ///
+    /// JS ToNumber, via stringToNumber.
+    ///
+    double toNumber() const;
+  };
+
+  ///
+  /// A String made by concatenation, which holds on to its two halves
+  /// until its characters are first needed. Then they're copied into a
+  /// buffer of its own outside the GC heap, and the halves let go.
+  ///
+  /// Ropes are at most maxDepth deep, so walking one never recurses far.
+  ///
+  class Rope : public String {
+    mutable String* mLeft;
+    mutable String* mRight;
+    mutable void* mFlat;
+    uint32_t mDepth;
+
+    friend class String;
+
+    Rope(String& aLeft, String& aRight, uint32_t aDepth);
+
+  public:
+    // Shorter results are copied flat; a Rope cell is bigger than that.
+    static const size_t minLength = 32;
+    static const uint32_t maxDepth = 64;
+
+    Rope(Rope&& aOther);
+
+    ~Rope() override;
+
+    GCThing* relocateForGC(void* aDest) override;
+
+    void traceRefs(GCTracer& aTracer);
+
+    ///
+    /// Nesting of unflattened Ropes under this one; 0 once flattened.
+    ///
+    uint32_t depth() const {
+      return mFlat ? 0 : mDepth;
+    }
+
+    ///
+    /// Our characters, copied out on first use.
+    ///
+    const void* flatten() const;
+  };
+
+  ///
+  /// A String made from part of another, sharing its characters. The
+  /// parent is always flat or a flattened Rope, never another Slice, and
+  /// is kept alive by the Slice.
+  ///
+  class Slice : public String {
+    String* mParent;
+    uint32_t mOffset;
+
+    friend class String;
+
+    Slice(String& aParent, size_t aOffset, size_t aLength);
+
+  public:
+    // Shorter results are copied; a Slice cell is bigger than that.
+    static const size_t minLength = 16;
+
+    // Copy results up to maxCopyLength chars, too, rather than keep alive
+    // a parent more than maxWaste times their size.
+    static const size_t maxCopyLength = 256;
+    static const size_t maxWaste = 64;
+
+    Slice(Slice&& aOther) = default;
+
+    GCThing* relocateForGC(void* aDest) override;
+
+    void traceRefs(GCTracer& aTracer);
+
+    const void* sliceChars() const {
+      const uint8_t* chars = static_cast<const uint8_t*>(mParent->rawChars());
+      return chars + (isTwoByte() ? 2 * mOffset : mOffset);
     }
   };
 
@@ -1026,21 +2418,28 @@ namespace AotJS {
 
   public:
     Symbol(string const &aName)
-    : PropIndex(),
+    : PropIndex(GCKind::Symbol),
       name(aName)
     {
       //
     }
 
+    Symbol(Symbol&& aOther) = default;
+
     ~Symbol() override;
 
-    TypeOf typeOf() const override;
+    // Symbols are hashed by address as property keys, so never move them.
+    static void* operator new(size_t aSize) {
+      return allocateTenured(aSize);
+    }
+
+    GCThing* relocateForGC(void* aDest) override;
 
     string dump() override;
 
     Retained<String> toString() const override {
       ScopeRet<String> scope;
-      return scope.escape(new String("Symbol(" + getName() + ")"));
+      return scope.escape(String::create("Symbol(" + getName() + ")"));
     }
 
     const string &getName() const {
@@ -1057,62 +2456,93 @@ namespace AotJS {
   ///
   class Object : public JSThing {
     Object *mPrototype;
-    unordered_map<Val,Val> mProps;
+    // Keyed by atom or Symbol, so lookups hash and compare addresses.
+    unordered_map<PropIndex*,Val> mProps;
+
+  protected:
+    explicit Object(GCKind aKind)
+    : JSThing(aKind),
+      mPrototype(nullptr)
+    {
+      //
+    }
 
   public:
     Object()
-    : JSThing(),
+    : JSThing(GCKind::Object),
       mPrototype(nullptr)
     {
       //
     }
 
     Object(Object& aPrototype)
-    : JSThing(),
+    : JSThing(GCKind::Object),
       mPrototype(&aPrototype)
     {
       // Note this doesn't call the constructor,
       // which would be done by outside code.
+      engine().writeBarrier(*this, mPrototype);
     }
 
+    Object(Object&& aOther) = default;
+
     ~Object() override;
 
-    void markRefsForGC() override;
+    GCThing* relocateForGC(void* aDest) override;
+    void traceRefs(GCTracer& aTracer);
     string dump() override;
-    TypeOf typeOf() const override;
 
     Retained<String> toString() const override {
       ScopeRet<String> scope;
       // todo get the constructor name
-      return scope.escape(new String("[object Object]"));
+      return scope.escape(String::create("[object Object]"));
     }
 
-    Local getProp(Local name);
-    void setProp(Local name, Local val);
+    ///
+    /// Property access takes the object as a Local too. A young object
+    /// moves if a minor GC runs, and a member call's `this` is worked out
+    /// before its arguments, any of which might allocate.
+    ///
+    static Local getProp(Local aObj, Local aName);
+    static void setProp(Local aObj, Local aName, Local aVal);
   };
 
   ///
   /// Represents a closure-captured JS variable, allocated on the heap in
   /// this wrapper object.
   ///
+  /// Cells are always tenured, since Locals point straight into them via
+  /// binding(). Writes through those pointers can't be barriered, so every
+  /// Cell stays in the engine's remembered set for its whole life.
+  ///
   class Cell : public Internal {
     Val mVal;
 
   public:
     Cell()
-    : mVal(Undefined())
+    : Internal(GCKind::Cell),
+      mVal(Undefined())
     {
-      //
+      engine().rememberCellForGC(*this);
     }
 
     Cell(Val aVal)
-    : mVal(aVal)
+    : Internal(GCKind::Cell),
+      mVal(aVal)
     {
-      //
+      engine().rememberCellForGC(*this);
     }
 
+    Cell(Cell&& aOther) = default;
+
     ~Cell() override;
 
+    static void* operator new(size_t aSize) {
+      return allocateTenured(aSize);
+    }
+
+    GCThing* relocateForGC(void* aDest) override;
+
     Val* binding() {
       return &mVal;
     }
@@ -1121,7 +2551,7 @@ namespace AotJS {
       return mVal;
     }
 
-    void markRefsForGC() override;
+    void traceRefs(GCTracer& aTracer);
     string dump() override;
   };
 
@@ -1129,6 +2559,10 @@ namespace AotJS {
   /// Represents a runtime function object.
   /// References the
   ///
+  /// Functions are always tenured: bodies get a Function& that must stay
+  /// valid across allocations. Captures are Cells, which are tenured too,
+  /// so they never need a write barrier.
+  ///
   class Function : public Object {
     std::string mName;
     size_t mArity;
@@ -1141,7 +2575,7 @@ namespace AotJS {
       std::string aName,
       size_t aArity,
       FunctionBody aBody)
-    : Object(), // todo: have a function prototype object!
+    : Object(GCKind::Function), // todo: have a function prototype object!
       mName(aName),
       mArity(aArity),
       mCaptures(),
@@ -1156,7 +2590,7 @@ namespace AotJS {
       size_t aArity,
       RawCaptureList aCaptures,
       FunctionBody aBody)
-    : Object(), // todo: have a function prototype object!
+    : Object(GCKind::Function), // todo: have a function prototype object!
       mName(aName),
       mArity(aArity),
       mCaptures(aCaptures),
@@ -1165,9 +2599,15 @@ namespace AotJS {
       //
     }
 
+    Function(Function&& aOther) = default;
+
     ~Function() override;
 
-    TypeOf typeOf() const override;
+    static void* operator new(size_t aSize) {
+      return allocateTenured(aSize);
+    }
+
+    GCThing* relocateForGC(void* aDest) override;
 
     std::string name() const {
       return mName;
@@ -1189,12 +2629,12 @@ namespace AotJS {
       return *mCaptures[aIndex];
     }
 
-    void markRefsForGC() override;
+    void traceRefs(GCTracer& aTracer);
     string dump() override;
 
     Retained<String> toString() const override {
       ScopeRet<String> scope;
-      return scope.escape(new String("[Function: " + name() + "]"));
+      return scope.escape(String::create("[Function: " + name() + "]"));
     }
 
   };
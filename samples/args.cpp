@@ -29,8 +29,8 @@ int main() {
       }
     );
 
-    report->call(Null(), {new String("a"), new String("b"), new String("c")});
-    report->call(Null(), {new String("a"), new String("b")});
+    report->call(Null(), {String::create("a"), String::create("b"), String::create("c")});
+    report->call(Null(), {String::create("a"), String::create("b")});
     report->call(Null(), {1, 2, 3});
     report->call(Null(), {new Object(), 3.5, Null()});
   }
@@ -30,7 +30,7 @@ int main() {
       // JS variable bindings are all pointers, either wrapped with a Local
       // or Retained<T> smart pointer to the stack or straight as a Binding
       // pointer into one of those.
-      Retained<Cell> _b;
+      Retained<Cell> _b(new Cell());
 
       Local a;
       Local b(_b->binding());
@@ -56,15 +56,15 @@ int main() {
           Local b(func.capture(0).binding());
 
           // replace the variable in the parent scope
-          b = new String("b plus one");
+          b = String::create("b plus one");
 
           return scope.escape(Undefined());
         }
       );
 
       // Now we get to the body of the function:
-      a = new String("a");
-      b = new String("b");
+      a = String::create("a");
+      b = String::create("b");
 
       std::cout << "should say 'b': " << b->dump() << "\n";
 
@@ -46,20 +46,20 @@ int main() {
       // Remember JS variable bindings are modeled as pointers to Val cells,
       // which we are filling with object pointers.
       obj = new Object();
-      objname = new String("an_obj");
-      propname = new String("propname");
-      propval = new String("propval");
-      unused = new String("unused");
+      objname = String::create("an_obj");
+      propname = String::create("propname");
+      propval = String::create("propval");
+      unused = String::create("unused");
 
       // This string is a different instance from the earlier "propname" one,
       // and should not survive GC.
-      notpropname = new String(std::string("prop") + std::string("name"));
+      notpropname = String::create(std::string("prop") + std::string("name"));
 
       // Retain a couple strings on an object
       // @todo this would be done with a wrapper interface probably
-      obj->asObject().setProp(propname, propval);
+      Object::setProp(obj, propname, propval);
 
-      root->asObject().setProp(objname, obj);
+      Object::setProp(root, objname, obj);
 
       return scope.escape(Undefined());
     }
@@ -53,7 +53,7 @@ int main() {
     Scope scopeRow;
 
     y = (row / rows) * (y1 - y0) + y0;
-    str = new String("");
+    str = String::create("");
 
     for (col = 0; col < cols; col++) {
       Scope scopeCol;
@@ -62,15 +62,15 @@ int main() {
       iters = iterate_mandelbrot->call(Null(), {x, y, maxIters});
 
       if (iters == 0) {
-        str += new String(".");
+        str += String::create(".");
       } else if (iters == 1) {
-        str += new String("%");
+        str += String::create("%");
       } else if (iters == 2) {
-        str += new String("@");
+        str += String::create("@");
       } else if (iters == maxIters) {
-        str += new String(" ");
+        str += String::create(" ");
       } else {
-        str += new String("#");
+        str += String::create("#");
       }
     }
     std::cout << str->dump() << "\n";
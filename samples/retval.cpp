@@ -21,7 +21,7 @@ int main() {
       // no scope capture
       [] (Function& func, Local this_, ArgList args) -> Local {
         ScopeRetVal scope;
-        return scope.escape(new String("work"));
+        return scope.escape(String::create("work"));
       }
     );
 
@@ -30,7 +30,7 @@ int main() {
       0, // argument count
       [] (Function& func, Local this_, ArgList args) -> Local {
         ScopeRetVal scope;
-        return scope.escape(new String("play"));
+        return scope.escape(String::create("play"));
       }
     );
 
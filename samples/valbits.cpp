@@ -0,0 +1,62 @@
+#include "../aotjs_runtime.h"
+
+#include <cstring>
+#include <iostream>
+#include <random>
+
+using namespace AotJS;
+
+// Encodes doubles as Vals and decodes them again, checking every one comes
+// back bit for bit (or as a NaN), and is tagged as a number. Exits non-zero
+// on any failure, so the Val layouts can be checked on their own.
+
+static long checked = 0;
+static long failed = 0;
+
+static void check(uint64_t aBits) {
+  double d;
+  std::memcpy(&d, &aBits, sizeof(d));
+  Val val(d);
+  bool ok = val.isNumber();
+  if (ok) {
+    double back = val.toDouble();
+    ok = d != d ? back != back : std::memcmp(&back, &d, sizeof(d)) == 0;
+  }
+  #ifdef VAL_SHIFTED_NAN_BOX
+  // Every double is stored inline, and must stay off the other tags.
+  ok = ok && !val.isGCThing() && !val.isImmediate() && !val.isInt32() && val.isDouble();
+  #endif
+  checked++;
+  if (!ok && failed++ < 10) {
+    std::cout << "bad round trip: 0x" << std::hex << aBits << std::dec << "\n";
+  }
+}
+
+int main() {
+  Scope scope;
+
+  // Every sign and exponent, with the edges of the mantissa.
+  const uint64_t mantissas[] = {
+    0, 1, 0xffff'ffff, 0x7fff'ffff'ffff, 0x8000'0000'0000, 0xf'ffff'ffff'ffff
+  };
+  for (uint64_t top = 0; top < 0x1000; top++) {
+    for (uint64_t mantissa : mantissas) {
+      check((top << 52) | mantissa);
+    }
+  }
+
+  // Every top 16 bits, which is where the tags live.
+  for (uint64_t top = 0; top < 0x10000; top++) {
+    check(top << 48);
+    check((top << 48) | 1);
+  }
+
+  // And a good sample of everything else.
+  std::mt19937_64 rng(1);
+  for (int i = 0; i < 10'000'000; i++) {
+    check(rng());
+  }
+
+  std::cout << failed << " bad of " << checked << " doubles\n";
+  return failed ? 1 : 0;
+}